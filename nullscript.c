@@ -0,0 +1,4541 @@
+#include "nullscript.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct ASTNode ASTNode;
+typedef struct WatchUnit WatchUnit;
+
+//ヒープオブジェクトの共通ヘッダ。アトムはヒープに置かずポインタに埋め込む
+struct Value {
+    unsigned int type : 8;
+    unsigned int hash : 24;
+    int ref_count;
+};
+
+typedef struct {
+    Value header;
+    Value* car;
+    Value* cdr;
+} Pair;
+
+typedef struct {
+    Value header;
+    char* name;
+    char** params;
+    int param_count;
+    int cse_slots;
+    bool pure;
+    ASTNode* body;
+    Environment* closure;
+} Function;
+
+typedef struct {
+    Value header;
+    char* name;
+    Value* (*func)(Value** args, int argc, Environment* env);
+} Builtin;
+
+//read_file/stdinの読み込み元。mmapできない入力はFILEから1文字ずつ読む
+typedef struct {
+    int ref_count;
+    unsigned char* data;
+    size_t length;
+    size_t released;
+    FILE* file;
+} InputSource;
+
+//まだ読んでいない入力リストの残り。辿られた時にその場でPairに書き換わる
+typedef struct {
+    Value header;
+    InputSource* source;
+    size_t position;
+} Stream;
+
+enum { FUTURE_QUEUED, FUTURE_RUNNING, FUTURE_DONE };
+
+//future(f, args...)の結果。プールのキューも参照を一つ持つ
+typedef struct {
+    Value header;
+    NsInterp* root;
+    Value* func;
+    Value** args;
+    int argc;
+    int state;
+    Value* result;
+    NsStatus status;
+    char* error;
+} Future;
+
+//list(...)の要素を連続して持つブロック。スライスはブロック内の位置を指すタグ付きポインタ
+typedef struct {
+    int ref_count;
+    int count;
+    Value* next;
+    Value* elements[];
+} ListChunk;
+
+#define LIST_CHUNK_MAX 1024
+
+//下位2bit: x1 = アトム, 10 = スライス, 00 = ヒープオブジェクト
+//スライスは上位16bitに要素の位置を持つ
+#define IS_IMMEDIATE(val) (((uintptr_t)(val)) & 1)
+#define IS_SLICE(val) ((((uintptr_t)(val)) & 3) == 2)
+#define IS_OBJECT(val) ((val) && (((uintptr_t)(val)) & 3) == 0)
+#define MAKE_SLICE(chunk, index) ((Value*)((uintptr_t)(chunk) | ((uintptr_t)(index) << 48) | 2))
+#define SLICE_CHUNK(val) ((ListChunk*)((uintptr_t)(val) & 0x0000fffffffffffcULL))
+#define SLICE_INDEX(val) ((int)((uintptr_t)(val) >> 48))
+#define CHUNK_HASHES(chunk) ((unsigned int*)((chunk)->elements + (chunk)->count))
+#define MAKE_IMMEDIATE(type) ((Value*)(uintptr_t)(((type) << 1) | 1))
+#define AS_PAIR(val) ((Pair*)(val))
+#define AS_FUNCTION(val) ((Function*)(val))
+#define AS_BUILTIN(val) ((Builtin*)(val))
+#define AS_STREAM(val) ((Stream*)(val))
+#define AS_FUTURE(val) ((Future*)(val))
+
+_Static_assert(sizeof(Stream) <= sizeof(Pair), "a stream cell is rewritten into a pair in place");
+
+static void stream_force(Value* val);
+
+static inline ValueType value_type(Value* val) {
+    if (IS_IMMEDIATE(val)) return (ValueType)((uintptr_t)val >> 1);
+    if (IS_SLICE(val)) return VAL_PAIR;
+    if (val->type == VAL_STREAM) stream_force(val);
+    return (ValueType)val->type;
+}
+
+//どちらも借用参照を返す
+static inline Value* pair_car(Value* val) {
+    if (IS_SLICE(val)) return SLICE_CHUNK(val)->elements[SLICE_INDEX(val)];
+    return AS_PAIR(val)->car;
+}
+
+static inline Value* pair_cdr(Value* val) {
+    if (IS_SLICE(val)) {
+        ListChunk* chunk = SLICE_CHUNK(val);
+        int index = SLICE_INDEX(val) + 1;
+        return index < chunk->count ? MAKE_SLICE(chunk, index) : chunk->next;
+    }
+    return AS_PAIR(val)->cdr;
+}
+
+//最初のTOKENいらないだろ
+typedef enum {
+    TOKEN_NONE, TOKEN_NIL, TOKEN_UNDEFINED, TOKEN_NULL,
+    TOKEN_FUNCTION, TOKEN_IF, TOKEN_ELSE, TOKEN_MATCH, TOKEN_CASE, TOKEN_DEFAULT,
+    TOKEN_PAIR, TOKEN_LIST, TOKEN_IDENTIFIER,
+    TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_LBRACE, TOKEN_RBRACE,
+    TOKEN_COMMA, TOKEN_ARROW, TOKEN_EOF,
+    //エラーメッセージの番号が変わらないよう、後から足したものは末尾に置く
+    TOKEN_NUMBER, TOKEN_STRING
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    char* value;
+    int line;
+    int column;
+} Token;
+
+typedef struct {
+    char* input;
+    int pos;
+    int length;
+    int line;
+    int column;
+} Lexer;
+
+typedef enum {
+    AST_VALUE, AST_IDENTIFIER, AST_PAIR, AST_LIST,
+    AST_FUNCTION_CALL, AST_FUNCTION_DEF, AST_IF, AST_MATCH, AST_CSE
+} ASTType;
+
+//--heap-profile の割り当て元ごとの集計
+typedef struct {
+    ASTNode* node;
+    long alloc_count;
+    long alloc_bytes;
+    long live_count;
+    long live_bytes;
+} HeapSite;
+
+struct ASTNode {
+    ASTType type;
+    int line;
+    int column;
+    HeapSite* heap_site;
+    union {
+        Value* value;
+        char* identifier;
+        struct {
+            ASTNode* car;
+            ASTNode* cdr;
+            //使う式の外に逃げないので、その間だけregionに置ける
+            bool stack;
+        } pair;
+        struct {
+            ASTNode** elements;
+            int count;
+        } list;
+        struct {
+            ASTNode* func;
+            ASTNode** args;
+            int argc;
+            //呼び出し先の本体を引数で置き換えたもの。関数が再定義されていなければこちらを評価する
+            ASTNode* inlined;
+            //展開元の定義の本体。呼び出す名前がこの定義に束縛されている時だけinlinedを使う
+            ASTNode* inlined_from;
+        } call;
+        struct {
+            char* name;
+            char** params;
+            int param_count;
+            ASTNode* body;
+            bool pure;
+            int cse_slots;
+        } func_def;
+        struct {
+            ASTNode* condition;
+            ASTNode* then_branch;
+            ASTNode* else_branch;
+        } if_node;
+        struct {
+            ASTNode* value;
+            ASTNode** patterns;
+            ASTNode** bodies;
+            int case_count;
+            ASTNode* default_case;
+            bool* reuse;
+        } match;
+        struct {
+            ASTNode* expr;
+            int slot;
+            int visit;
+        } cse;
+    } data;
+};
+
+typedef struct EnvironmentEntry {
+    char* name;
+    Value* value;
+    struct EnvironmentEntry* next;
+} EnvironmentEntry;
+
+struct Environment {
+    EnvironmentEntry* bindings;
+    Environment* parent;
+    Value** cse_values;
+    int cse_count;
+    int ref_count;
+};
+
+typedef struct {
+    Token* tokens;
+    int pos;
+    int count;
+} Parser;
+
+//--stats 用のカウンタ
+typedef struct {
+    double lex_ms;
+    double parse_ms;
+    double optimize_ms;
+    double eval_ms;
+    long value_new;
+    long value_reuse;
+    long value_stack;
+    long value_retain;
+    long value_release;
+    long value_free;
+    long env_new;
+    long live_values;
+    long peak_values;
+    long live_envs;
+    long peak_envs;
+    int depth;
+    int peak_depth;
+    long nodes[AST_CSE + 1];
+} Stats;
+
+typedef struct MemoEntry {
+    Value* func;
+    Value** args;
+    int argc;
+    unsigned long hash;
+    Value* result;
+    struct MemoEntry* bucket_next;
+    struct MemoEntry* lru_prev;
+    struct MemoEntry* lru_next;
+} MemoEntry;
+
+typedef struct {
+    MemoEntry** buckets;
+    int bucket_count;
+    int size;
+    MemoEntry* lru_head;
+    MemoEntry* lru_tail;
+    long hits;
+    long misses;
+    long evictions;
+} MemoCache;
+
+typedef struct {
+    char* name;
+    ASTNode* def;
+    int def_count;
+    int parse;
+} FunctionInfo;
+
+typedef struct {
+    FunctionInfo* funcs;
+    int count;
+    int capacity;
+} ProgramInfo;
+
+//ASTはインタプリタと同じだけ生きるのでまとめて確保してまとめて捨てる
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+//スケジューラのジョブ。評価の途中状態は専用スタックごと保存される
+typedef struct Job {
+    NsInterp* ns;
+    char* source;
+    ucontext_t context;
+    void* stack;
+    long slice;
+    bool done;
+    struct Job* next;
+} Job;
+
+//ジョブは投入されたワーカーから動かない。スレッドローカルなcurrentをまたがせないため
+typedef struct {
+    NsScheduler* scheduler;
+    pthread_t thread;
+    ucontext_t context;
+    Job* head;
+    Job* tail;
+    Job* running;
+} Worker;
+
+struct NsScheduler {
+    Worker* workers;
+    int worker_count;
+    int next_worker;
+    long slice;
+};
+
+typedef struct {
+    size_t time;
+    size_t heap_bytes;
+    bool peak;
+    int count;
+    HeapSite** sites;
+    long* bytes;
+} HeapSnapshot;
+
+//時間は割り当てたバイト数で数える
+typedef struct {
+    HeapSite unknown;
+    HeapSite** sites;
+    int site_count;
+    int site_capacity;
+    size_t total_bytes;
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t next_sample;
+    size_t interval;
+    HeapSnapshot* snapshots;
+    int snapshot_count;
+    HeapSnapshot peak;
+} HeapProfile;
+
+struct NsProgram {
+    ASTNode** statements;
+    int count;
+};
+
+struct NsInterp {
+    NsOptions options;
+    Stats stats;
+    MemoCache memo;
+    Environment* globals;
+    Value* char_encodings[256];
+    ArenaBlock* arena;
+    ProgramInfo functions;
+    int cse_visit;
+    int parse_count;
+    //展開で作った名前の通し番号
+    int inline_count;
+    //別のパースで関数が再定義されたら、それまでの純粋性は当てにならない
+    bool purity_stale;
+    bool running;
+    NsStatus status;
+    char error[256];
+    jmp_buf parse_error;
+    Lexer* lexer;
+    Token* tokens;
+    int token_count;
+    long fuel_used;
+    size_t heap_bytes;
+    Job* job;
+    long slice_used;
+    //matchで手放した一意なペアのセル。次のmake_pairが使う
+    Value* reuse;
+    //逃げないペアを積む領域。region_requestはregionに作ってよいペアのノード
+    Pair* region;
+    int region_used;
+    ASTNode* region_request;
+    //リテラルの値はASTと同じだけ生きる
+    Value** literals;
+    int literal_count;
+    int literal_capacity;
+    Value* numbers;
+    int number_length;
+    //futureの評価は親の環境を共有する影のインタプリタで行う。rootは元のインタプリタ
+    NsInterp* root;
+    bool parallel;
+    int pending_tasks;
+    pthread_mutex_t task_lock;
+    Stats task_stats;
+    //今評価している式。割り当て元として記録する
+    ASTNode* site_node;
+    HeapProfile profile;
+    //ns_updateで前回評価したトップレベルの文
+    WatchUnit* units;
+    int unit_count;
+};
+
+static __thread NsInterp* current;
+
+//futureを使い始めたインタプリタだけ参照カウントをアトミックにする
+static inline int ref_add(int* count, int delta) {
+    if (current->parallel) return __atomic_add_fetch(count, delta, __ATOMIC_ACQ_REL);
+    return *count += delta;
+}
+
+//参照カウントを読む。並列評価中は他のスレッドのref_addと揃える
+static inline int ref_load(int* count) {
+    if (current->parallel) return __atomic_load_n(count, __ATOMIC_ACQUIRE);
+    return *count;
+}
+
+static inline void heap_add(long delta) {
+    NsInterp* root = current->root;
+    if (current->parallel) {
+        __atomic_add_fetch(&root->heap_bytes, (size_t)delta, __ATOMIC_RELAXED);
+    } else {
+        root->heap_bytes += delta;
+    }
+}
+
+static inline void counter_add(long* counter, long delta) {
+    if (current->parallel) {
+        __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+    } else {
+        *counter += delta;
+    }
+}
+
+#define HEAP_SNAPSHOT_MAX 100
+
+static void profile_snapshot(HeapSnapshot* snapshot, bool peak) {
+    HeapProfile* profile = &current->profile;
+    snapshot->time = profile->total_bytes;
+    snapshot->heap_bytes = profile->live_bytes;
+    snapshot->peak = peak;
+    snapshot->count = 0;
+    snapshot->sites = malloc(sizeof(HeapSite*) * (profile->site_count + 1));
+    snapshot->bytes = malloc(sizeof(long) * (profile->site_count + 1));
+    for (int i = -1; i < profile->site_count; i++) {
+        HeapSite* site = i < 0 ? &profile->unknown : profile->sites[i];
+        long bytes = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+        if (bytes <= 0) continue;
+        snapshot->sites[snapshot->count] = site;
+        snapshot->bytes[snapshot->count] = bytes;
+        snapshot->count++;
+    }
+}
+
+static void snapshot_free(HeapSnapshot* snapshot) {
+    free(snapshot->sites);
+    free(snapshot->bytes);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+//一定量割り当てるごとと、ピークを1%以上更新した時に記録する
+//数が上限に達したら一つおきに捨てて間隔を倍にする
+static void profile_sample(void) {
+    HeapProfile* profile = &current->profile;
+    if (profile->live_bytes > profile->peak_bytes) profile->peak_bytes = profile->live_bytes;
+    if (profile->live_bytes > profile->peak.heap_bytes + profile->peak.heap_bytes / 100) {
+        snapshot_free(&profile->peak);
+        profile_snapshot(&profile->peak, true);
+    }
+    if (profile->total_bytes < profile->next_sample) return;
+
+    if (profile->snapshot_count == HEAP_SNAPSHOT_MAX) {
+        int kept = 0;
+        for (int i = 0; i < profile->snapshot_count; i++) {
+            if (i % 2 == 1) {
+                profile->snapshots[kept++] = profile->snapshots[i];
+            } else {
+                snapshot_free(&profile->snapshots[i]);
+            }
+        }
+        profile->snapshot_count = kept;
+        profile->interval *= 2;
+    }
+    profile_snapshot(&profile->snapshots[profile->snapshot_count++], false);
+    profile->next_sample = profile->total_bytes + profile->interval;
+}
+
+static void profile_count(HeapSite* site, long size) {
+    HeapProfile* profile = &current->root->profile;
+    if (size > 0) {
+        counter_add(&site->alloc_count, 1);
+        counter_add(&site->alloc_bytes, size);
+        counter_add((long*)&profile->total_bytes, size);
+    }
+    counter_add(&site->live_count, size > 0 ? 1 : -1);
+    counter_add(&site->live_bytes, size);
+    counter_add((long*)&profile->live_bytes, size);
+    //futureの中では数えるだけにして、記録は元のスレッドに任せる
+    if (current == current->root) profile_sample();
+}
+
+static HeapSite* current_site(void) {
+    ASTNode* node = current->site_node;
+    return node && node->heap_site ? node->heap_site : &current->root->profile.unknown;
+}
+
+//--heap-profile の時だけ、割り当ての前に割り当て元を置く
+static void* heap_alloc(size_t size) {
+    if (!current->options.heap_profile) return malloc(size);
+    HeapSite** header = malloc(sizeof(HeapSite*) + size);
+    *header = current_site();
+    profile_count(*header, size);
+    return header + 1;
+}
+
+static void heap_free(void* ptr, size_t size) {
+    if (!current->options.heap_profile) {
+        free(ptr);
+        return;
+    }
+    HeapSite** header = (HeapSite**)ptr - 1;
+    profile_count(*header, -(long)size);
+    free(header);
+}
+
+//使い回したセルは新しい割り当て元の割り当てとして数え直す
+static void heap_retag(void* ptr, size_t size) {
+    if (!current->options.heap_profile) return;
+    HeapSite** header = (HeapSite**)ptr - 1;
+    profile_count(*header, -(long)size);
+    *header = current_site();
+    profile_count(*header, size);
+}
+static __thread Worker* worker_self;
+
+//実行時エラー。評価器はNULLを返して呼び出し元まで戻る
+static Value* fail(NsStatus status, const char* format, ...) {
+    if (current->status == NS_OK) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(current->error, sizeof(current->error), format, args);
+        va_end(args);
+        current->status = status;
+    }
+    return NULL;
+}
+
+//パースを中断する。ASTはアリーナにあるのでns_parseまで一気に戻る
+static void parse_abort(NsStatus status, const char* format, va_list args) {
+    vsnprintf(current->error, sizeof(current->error), format, args);
+    current->status = status;
+    longjmp(current->parse_error, 1);
+}
+
+static void parse_fail(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    parse_abort(NS_ERR_SYNTAX, format, args);
+}
+
+//リテラルを作るのにメモリが足りない
+static void parse_fail_memory(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    parse_abort(NS_ERR_MEMORY, format, args);
+}
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static void* arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock* block = current->arena;
+    if (!block || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        block->next = current->arena;
+        block->used = 0;
+        block->size = block_size;
+        current->arena = block;
+    }
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+//アリーナ上のポインタ配列に一つ足す。伸ばした時の古い領域はアリーナと一緒に捨てる
+static void* arena_append(void* array, int count, int* capacity, void* item) {
+    void** items = array;
+    if (count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 8;
+        void** larger = arena_alloc(sizeof(void*) * grown);
+        if (count) memcpy(larger, items, sizeof(void*) * count);
+        items = larger;
+        *capacity = grown;
+    }
+    items[count] = item;
+    return items;
+}
+
+static char* arena_strdup(const char* str) {
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(len), str, len);
+}
+
+
+//--statsのカウンタは有効な時だけ数える
+static inline void count_value_new(void) {
+    Stats* stats = &current->stats;
+    if (!current->options.stats) return;
+    stats->value_new++;
+    if (++stats->live_values > stats->peak_values) stats->peak_values = stats->live_values;
+}
+
+static inline void count_value_free(void) {
+    if (!current->options.stats) return;
+    current->stats.value_free++;
+    current->stats.live_values--;
+}
+
+static Value* value_new(ValueType type, size_t size) {
+    Value* val = heap_alloc(size);
+    val->type = type;
+    val->hash = 0;
+    val->ref_count = 1;
+    heap_add(size);
+    count_value_new();
+    return val;
+}
+
+static void value_retain(Value* val) {
+    if (!val || IS_IMMEDIATE(val)) return;
+
+    if (IS_SLICE(val)) {
+        ref_add(&SLICE_CHUNK(val)->ref_count, 1);
+    } else {
+        ref_add(&val->ref_count, 1);
+    }
+    if (current->options.stats) current->stats.value_retain++;
+}
+
+static void value_release(Value* val);
+
+static void source_release(InputSource* source);
+
+static size_t value_size(Value* val) {
+    switch (val->type) {
+        case VAL_FUNCTION: return sizeof(Function);
+        case VAL_BUILTIN: return sizeof(Builtin);
+        case VAL_FUTURE: return sizeof(Future);
+        default: return sizeof(Pair);
+    }
+}
+
+static size_t chunk_size(int count) {
+    return sizeof(ListChunk) + (sizeof(Value*) + sizeof(unsigned int)) * count;
+}
+
+static void value_release(Value* val) {
+    //長いリストでスタックを使い切らないようcdrはループで解放する
+    while (val && !IS_IMMEDIATE(val)) {
+        if (current->options.stats) current->stats.value_release++;
+
+        if (IS_SLICE(val)) {
+            ListChunk* chunk = SLICE_CHUNK(val);
+            if (ref_add(&chunk->ref_count, -1) > 0) return;
+            count_value_free();
+            heap_add(-(long)chunk_size(chunk->count));
+
+            for (int i = 0; i < chunk->count; i++) {
+                value_release(chunk->elements[i]);
+            }
+            val = chunk->next;
+            heap_free(chunk, chunk_size(chunk->count));
+            continue;
+        }
+
+        if (ref_add(&val->ref_count, -1) > 0) return;
+        size_t size = value_size(val);
+        count_value_free();
+        heap_add(-(long)size);
+
+        Value* next = NULL;
+        switch (val->type) {
+            case VAL_PAIR:
+                value_release(AS_PAIR(val)->car);
+                next = AS_PAIR(val)->cdr;
+                break;
+            case VAL_FUNCTION:
+                free(AS_FUNCTION(val)->name);
+                for (int i = 0; i < AS_FUNCTION(val)->param_count; i++) {
+                    free(AS_FUNCTION(val)->params[i]);
+                }
+                free(AS_FUNCTION(val)->params);
+                break;
+            case VAL_BUILTIN:
+                free(AS_BUILTIN(val)->name);
+                break;
+            case VAL_STREAM:
+                source_release(AS_STREAM(val)->source);
+                break;
+            case VAL_FUTURE:
+                value_release(AS_FUTURE(val)->func);
+                for (int i = 0; i < AS_FUTURE(val)->argc; i++) {
+                    value_release(AS_FUTURE(val)->args[i]);
+                }
+                free(AS_FUTURE(val)->args);
+                value_release(AS_FUTURE(val)->result);
+                free(AS_FUTURE(val)->error);
+                break;
+            default:
+                break;
+        }
+        heap_free(val, size);
+        val = next;
+    }
+}
+
+//全部分けなくてよかったかも
+static Value* make_none() {
+    return MAKE_IMMEDIATE(VAL_NONE);
+}
+
+static Value* make_nil() {
+    return MAKE_IMMEDIATE(VAL_NIL);
+}
+
+static Value* make_undefined() {
+    return MAKE_IMMEDIATE(VAL_UNDEFINED);
+}
+
+static Value* make_null() {
+    return MAKE_IMMEDIATE(VAL_NULL);
+}
+
+//構造ハッシュ。ペアは作る時に計算しておくので常にO(1)
+//0は未確定 (読み終わっていない入力を含む)
+static unsigned int value_hash(Value* val) {
+    if (IS_SLICE(val)) return CHUNK_HASHES(SLICE_CHUNK(val))[SLICE_INDEX(val)];
+    if (IS_OBJECT(val) && val->type == VAL_STREAM) return 0;
+
+    switch (value_type(val)) {
+        case VAL_PAIR:
+            return val->hash;
+        case VAL_FUNCTION:
+        case VAL_BUILTIN:
+            return (unsigned int)((uintptr_t)val >> 4);
+        default:
+            return value_type(val) + 1;
+    }
+}
+
+static unsigned int combine_hash(unsigned int car_hash, unsigned int cdr_hash) {
+    if (!car_hash || !cdr_hash) return 0;
+
+    unsigned int hash = ((car_hash * 31 + cdr_hash) * 31 + VAL_PAIR) & 0xffffff;
+    return hash ? hash : 1;
+}
+
+static unsigned int pair_hash(Value* car, Value* cdr) {
+    return combine_hash(value_hash(car), value_hash(cdr));
+}
+
+static Value* make_pair(Value* car, Value* cdr) {
+    Value* val = current->reuse;
+    if (val) {
+        current->reuse = NULL;
+        val->ref_count = 1;
+        if (current->options.stats) current->stats.value_reuse++;
+        heap_retag(val, sizeof(Pair));
+    } else {
+        val = value_new(VAL_PAIR, sizeof(Pair));
+    }
+    AS_PAIR(val)->car = car;
+    AS_PAIR(val)->cdr = cdr;
+    val->hash = pair_hash(car, cdr);
+    value_retain(car);
+    value_retain(cdr);
+    return val;
+}
+
+static void reuse_flush(void) {
+    Value* val = current->reuse;
+    if (!val) return;
+    current->reuse = NULL;
+    count_value_free();
+    heap_add(-(long)sizeof(Pair));
+    heap_free(val, sizeof(Pair));
+}
+
+#define REGION_CAPACITY 1024
+
+//carとcdrの参照を引き取る。領域が一杯ならNULLを返し、呼び出し元はヒープに作る
+static Value* region_pair(Value* car, Value* cdr) {
+    if (!current->region) current->region = malloc(sizeof(Pair) * REGION_CAPACITY);
+    if (current->region_used == REGION_CAPACITY) return NULL;
+
+    Value* val = &current->region[current->region_used++].header;
+    val->type = VAL_PAIR;
+    val->ref_count = 1;
+    AS_PAIR(val)->car = car;
+    AS_PAIR(val)->cdr = cdr;
+    val->hash = pair_hash(car, cdr);
+    if (current->options.stats) current->stats.value_stack++;
+    return val;
+}
+
+static bool in_region(Value* val) {
+    Pair* region = current->region;
+    return IS_OBJECT(val) && region && (Pair*)val >= region && (Pair*)val < region + REGION_CAPACITY;
+}
+
+//markより後に積んだペアをまとめて捨てる。セル自体は解放しない
+static void region_reset(int mark) {
+    while (current->region_used > mark) {
+        Pair* pair = &current->region[--current->region_used];
+        value_release(pair->car);
+        value_release(pair->cdr);
+    }
+}
+
+//参照が自分だけのペアは解放せず、中身だけ手放してセルを次のmake_pairに回す
+static void pair_drop_reuse(Value* val) {
+    value_release(AS_PAIR(val)->car);
+    value_release(AS_PAIR(val)->cdr);
+    reuse_flush();
+    current->reuse = val;
+}
+
+//elementsの参照を引き取ってtailに繋がるリストを作る
+static Value* make_list(Value** elements, int count, Value* tail) {
+    Value* result = tail;
+    value_retain(tail);
+
+    //後ろのブロックから作る。各ブロックのnextが次のブロックの先頭になる
+    for (int end = count; end > 0; end -= LIST_CHUNK_MAX) {
+        int start = end > LIST_CHUNK_MAX ? end - LIST_CHUNK_MAX : 0;
+        int length = end - start;
+
+        ListChunk* chunk = heap_alloc(chunk_size(length));
+        chunk->ref_count = 1;
+        chunk->count = length;
+        chunk->next = result;
+        memcpy(chunk->elements, elements + start, sizeof(Value*) * length);
+
+        unsigned int* hashes = CHUNK_HASHES(chunk);
+        unsigned int hash = value_hash(result);
+        for (int i = length - 1; i >= 0; i--) {
+            hash = combine_hash(value_hash(chunk->elements[i]), hash);
+            hashes[i] = hash;
+        }
+
+        heap_add(chunk_size(length));
+        count_value_new();
+        result = MAKE_SLICE(chunk, 0);
+    }
+    return result;
+}
+
+static int slice_remaining(Value* val) {
+    return SLICE_CHUNK(val)->count - SLICE_INDEX(val);
+}
+
+static Value* slice_advance(Value* val, int n) {
+    ListChunk* chunk = SLICE_CHUNK(val);
+    int index = SLICE_INDEX(val) + n;
+    return index < chunk->count ? MAKE_SLICE(chunk, index) : chunk->next;
+}
+
+//0から255までの数のエンコーディング。入力の各文字で共有する
+static Value* char_encoding(unsigned char c) {
+    Value** encodings = current->char_encodings;
+    if (!encodings[0]) {
+        encodings[0] = make_nil();
+        for (int i = 1; i < 256; i++) {
+            encodings[i] = make_pair(make_none(), encodings[i - 1]);
+        }
+    }
+    return encodings[c];
+}
+
+#define SOURCE_RELEASE_CHUNK (1 << 20)
+
+static void source_release(InputSource* source) {
+    if (ref_add(&source->ref_count, -1) > 0) return;
+
+    if (source->data) {
+        munmap(source->data, source->length);
+    }
+    free(source);
+}
+
+static Value* stream_new(InputSource* source, size_t position) {
+    Value* val = value_new(VAL_STREAM, sizeof(Pair));
+    AS_STREAM(val)->source = source;
+    AS_STREAM(val)->position = position;
+    ref_add(&source->ref_count, 1);
+    return val;
+}
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//先頭の1文字だけPairにして、残りは新しいStreamにする
+static void stream_force(Value* val) {
+    //futureから同じセルを同時に辿られた時は一度だけ読む
+    bool locked = current->parallel;
+    if (locked) {
+        pthread_mutex_lock(&stream_lock);
+        if (val->type != VAL_STREAM) {
+            pthread_mutex_unlock(&stream_lock);
+            return;
+        }
+    }
+
+    InputSource* source = AS_STREAM(val)->source;
+    size_t position = AS_STREAM(val)->position;
+    unsigned char c;
+    Value* rest;
+
+    if (source->data) {
+        c = source->data[position];
+        rest = position + 1 < source->length ? stream_new(source, position + 1) : make_nil();
+
+        //読み終わったページは捨ててよい (まだ参照があればファイルから読み直される)
+        if (position - source->released >= SOURCE_RELEASE_CHUNK) {
+            size_t end = position & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise(source->data + source->released, end - source->released, MADV_DONTNEED);
+            source->released = end;
+        }
+    } else {
+        c = (unsigned char)position;
+        int next = getc(source->file);
+        rest = next != EOF ? stream_new(source, (size_t)next) : make_nil();
+    }
+    source_release(source);
+
+    Value* car = char_encoding(c);
+    value_retain(car);
+    AS_PAIR(val)->car = car;
+    AS_PAIR(val)->cdr = rest;
+    val->hash = pair_hash(car, rest);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    val->type = VAL_PAIR;
+
+    if (locked) pthread_mutex_unlock(&stream_lock);
+}
+
+static InputSource* source_new(void) {
+    InputSource* source = calloc(1, sizeof(InputSource));
+    source->ref_count = 1;
+    return source;
+}
+
+//fdの中身を遅延リストにする。mmapできなければNULL
+static Value* stream_from_fd(int fd, bool* mapped) {
+    struct stat st;
+    *mapped = false;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0) start = 0;
+    *mapped = true;
+    if (start >= st.st_size) return make_nil();
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        *mapped = false;
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    lseek(fd, st.st_size, SEEK_SET);
+
+    InputSource* source = source_new();
+    source->data = data;
+    source->length = st.st_size;
+    Value* stream = stream_new(source, start);
+    source_release(source);
+    return stream;
+}
+
+static void env_retain(Environment* env) {
+    if (env) ref_add(&env->ref_count, 1);
+}
+
+static Environment* env_new(Environment* parent);
+
+static Environment* call_env_new(Function* fn) {
+    Environment* call_env = env_new(fn->closure);
+    if (fn->cse_slots > 0) {
+        call_env->cse_count = fn->cse_slots;
+        call_env->cse_values = calloc(call_env->cse_count, sizeof(Value*));
+    }
+    return call_env;
+}
+
+static Environment* env_new(Environment* parent) {
+    Environment* env = malloc(sizeof(Environment));
+    env->bindings = NULL;
+    env->parent = parent;
+    env_retain(parent);
+    env->cse_values = NULL;
+    env->cse_count = 0;
+    env->ref_count = 1;
+    heap_add(sizeof(Environment));
+    if (current->options.stats) {
+        current->stats.env_new++;
+        if (++current->stats.live_envs > current->stats.peak_envs) current->stats.peak_envs = current->stats.live_envs;
+    }
+    return env;
+}
+
+static void env_release(Environment* env) {
+    if (!env || ref_add(&env->ref_count, -1) > 0) return;
+
+    EnvironmentEntry* entry = env->bindings;
+    while (entry) {
+        EnvironmentEntry* next = entry->next;
+        free(entry->name);
+        value_release(entry->value);
+        free(entry);
+        heap_add(-(long)sizeof(EnvironmentEntry));
+        entry = next;
+    }
+    for (int i = 0; i < env->cse_count; i++) {
+        value_release(env->cse_values[i]);
+    }
+    free(env->cse_values);
+    Environment* parent = env->parent;
+    free(env);
+    heap_add(-(long)sizeof(Environment));
+    if (current->options.stats) current->stats.live_envs--;
+    env_release(parent);
+}
+
+//valueの参照を引き取って束縛する
+static void env_bind(Environment* env, const char* name, Value* value) {
+    EnvironmentEntry* entry = malloc(sizeof(EnvironmentEntry));
+    entry->name = strdup(name);
+    entry->value = value;
+    entry->next = env->bindings;
+    //グローバル環境はfutureから読まれているかもしれない
+    __atomic_store_n(&env->bindings, entry, __ATOMIC_RELEASE);
+    heap_add(sizeof(EnvironmentEntry));
+}
+
+static void env_define(Environment* env, const char* name, Value* value) {
+    env_bind(env, name, value);
+    value_retain(value);
+}
+
+static EnvironmentEntry* env_find(Environment* env, const char* name) {
+    for (; env; env = env->parent) {
+        for (EnvironmentEntry* entry = env->bindings; entry; entry = entry->next) {
+            if (strcmp(entry->name, name) == 0) {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+static Value* env_lookup(Environment* env, const char* name) {
+    EnvironmentEntry* entry = env_find(env, name);
+    return entry ? entry->value : NULL;
+}
+
+//この環境で関数に束縛されたnameを全部外す。組み込み関数は残す
+static void env_unbind_function(Environment* env, const char* name) {
+    EnvironmentEntry** link = &env->bindings;
+    while (*link) {
+        EnvironmentEntry* entry = *link;
+        if (strcmp(entry->name, name) != 0 || value_type(entry->value) != VAL_FUNCTION) {
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        free(entry->name);
+        value_release(entry->value);
+        free(entry);
+        heap_add(-(long)sizeof(EnvironmentEntry));
+    }
+}
+
+
+static Lexer* lexer_new(const char* input) {
+    Lexer* lexer = malloc(sizeof(Lexer));
+    lexer->input = strdup(input);
+    lexer->pos = 0;
+    lexer->length = strlen(input);
+    lexer->line = 1;
+    lexer->column = 1;
+    return lexer;
+}
+
+static void lexer_free(Lexer* lexer) {
+    free(lexer->input);
+    free(lexer);
+}
+
+static void skip_whitespace(Lexer* lexer) {
+    while (lexer->pos < lexer->length && isspace(lexer->input[lexer->pos])) {
+        if (lexer->input[lexer->pos] == '\n') {
+            lexer->line++;
+            lexer->column = 1;
+        } else {
+            lexer->column++;
+        }
+        lexer->pos++;
+    }
+}
+
+static bool match_keyword(Lexer* lexer, const char* keyword, TokenType* type) {
+    int len = strlen(keyword);
+    if (lexer->pos + len <= lexer->length &&
+        strncmp(lexer->input + lexer->pos, keyword, len) == 0 &&
+        (lexer->pos + len == lexer->length || !isalnum(lexer->input[lexer->pos + len]))) {
+
+        if (strcmp(keyword, "none") == 0) *type = TOKEN_NONE;
+        else if (strcmp(keyword, "nil") == 0) *type = TOKEN_NIL;
+        else if (strcmp(keyword, "undefined") == 0) *type = TOKEN_UNDEFINED;
+        else if (strcmp(keyword, "null") == 0) *type = TOKEN_NULL;
+        else if (strcmp(keyword, "function") == 0) *type = TOKEN_FUNCTION;
+        else if (strcmp(keyword, "if") == 0) *type = TOKEN_IF;
+        else if (strcmp(keyword, "else") == 0) *type = TOKEN_ELSE;
+        else if (strcmp(keyword, "match") == 0) *type = TOKEN_MATCH;
+        else if (strcmp(keyword, "case") == 0) *type = TOKEN_CASE;
+        else if (strcmp(keyword, "default") == 0) *type = TOKEN_DEFAULT;
+        else if (strcmp(keyword, "pair") == 0) *type = TOKEN_PAIR;
+        else if (strcmp(keyword, "list") == 0) *type = TOKEN_LIST;
+        else return false;
+
+        return true;
+    }
+    return false;
+}
+
+static Token next_token(Lexer* lexer) {
+    skip_whitespace(lexer);
+
+    Token token = {TOKEN_EOF, NULL, lexer->line, lexer->column};
+
+    if (lexer->pos >= lexer->length) {
+        return token;
+    }
+
+    char c = lexer->input[lexer->pos];
+
+    //単一文字
+    switch (c) {
+        case '(':
+            token.type = TOKEN_LPAREN;
+            token.value = strdup("(");
+            lexer->pos++;
+            lexer->column++;
+            return token;
+        case ')':
+            token.type = TOKEN_RPAREN;
+            token.value = strdup(")");
+            lexer->pos++;
+            lexer->column++;
+            return token;
+        case '{':
+            token.type = TOKEN_LBRACE;
+            token.value = strdup("{");
+            lexer->pos++;
+            lexer->column++;
+            return token;
+        case '}':
+            token.type = TOKEN_RBRACE;
+            token.value = strdup("}");
+            lexer->pos++;
+            lexer->column++;
+            return token;
+        case ',':
+            token.type = TOKEN_COMMA;
+            token.value = strdup(",");
+            lexer->pos++;
+            lexer->column++;
+            return token;
+    }
+
+    //->
+    if (c == '-' && lexer->pos + 1 < lexer->length && lexer->input[lexer->pos + 1] == '>') {
+        token.type = TOKEN_ARROW;
+        token.value = strdup("->");
+        lexer->pos += 2;
+        lexer->column += 2;
+        return token;
+    }
+
+    //#65 は数のリテラル
+    if (c == '#') {
+        int start = ++lexer->pos;
+        while (lexer->pos < lexer->length && isdigit(lexer->input[lexer->pos])) {
+            lexer->pos++;
+        }
+        int len = lexer->pos - start;
+        if (len == 0) {
+            parse_fail("number expected after '#' at line %d, column %d", lexer->line, lexer->column);
+        }
+        lexer->column += len + 1;
+        token.type = TOKEN_NUMBER;
+        token.value = strndup(lexer->input + start, len);
+        return token;
+    }
+
+    //"text" は文字コードのリスト。エスケープは \n \t \" \\ だけ
+    if (c == '"') {
+        char* text = malloc(lexer->length - lexer->pos);
+        int len = 0;
+        lexer->pos++;
+        lexer->column++;
+        while (lexer->pos < lexer->length && lexer->input[lexer->pos] != '"') {
+            char ch = lexer->input[lexer->pos++];
+            lexer->column++;
+            if (ch == '\n') {
+                lexer->line++;
+                lexer->column = 1;
+            } else if (ch == '\\' && lexer->pos < lexer->length) {
+                ch = lexer->input[lexer->pos++];
+                lexer->column++;
+                if (ch == 'n') ch = '\n';
+                else if (ch == 't') ch = '\t';
+                else if (ch != '"' && ch != '\\') {
+                    free(text);
+                    parse_fail("unknown escape \\%c at line %d, column %d", ch, lexer->line, lexer->column - 2);
+                }
+            }
+            text[len++] = ch;
+        }
+        text[len] = '\0';
+        if (lexer->pos >= lexer->length) {
+            free(text);
+            parse_fail("unterminated string at line %d, column %d", token.line, token.column);
+        }
+        lexer->pos++;
+        lexer->column++;
+        token.type = TOKEN_STRING;
+        token.value = text;
+        return token;
+    }
+
+    if (isalpha(c) || c == '_') {
+        int start = lexer->pos;
+        while (lexer->pos < lexer->length && (isalnum(lexer->input[lexer->pos]) || lexer->input[lexer->pos] == '_')) {
+            lexer->pos++;
+            lexer->column++;
+        }
+
+        int len = lexer->pos - start;
+        char* word = malloc(len + 1);
+        strncpy(word, lexer->input + start, len);
+        word[len] = '\0';
+
+        TokenType keyword_type;
+        lexer->pos = start;
+        lexer->column -= len;
+
+        if (match_keyword(lexer, word, &keyword_type)) {
+            lexer->pos += len;
+            lexer->column += len;
+            token.type = keyword_type;
+            token.value = word;
+            return token;
+        }
+
+        lexer->pos += len;
+        lexer->column += len;
+        token.type = TOKEN_IDENTIFIER;
+        token.value = word;
+        return token;
+    }
+
+    parse_fail("unknown character '%c' at line %d, column %d", c, lexer->line, lexer->column);
+    return token;
+}
+
+static Token* current_token(Parser* parser) {
+    if (parser->pos < parser->count) {
+        return &parser->tokens[parser->pos];
+    }
+    return NULL;
+}
+
+static Token* consume(Parser* parser, TokenType expected) {
+    Token* token = current_token(parser);
+    if (!token || token->type != expected) {
+        parse_fail("expected:  %d, actually: %d", expected, token ? (int)token->type : -1);
+    }
+    parser->pos++;
+    return token;
+}
+
+//atはその式の始まりのトークン
+static ASTNode* ast_new(ASTType type, Token* at) {
+    ASTNode* node = arena_alloc(sizeof(ASTNode));
+    node->type = type;
+    node->line = at ? at->line : 0;
+    node->column = at ? at->column : 0;
+    node->heap_site = NULL;
+    if (current->options.heap_profile) {
+        HeapProfile* profile = &current->profile;
+        node->heap_site = arena_alloc(sizeof(HeapSite));
+        memset(node->heap_site, 0, sizeof(HeapSite));
+        node->heap_site->node = node;
+        profile->sites = arena_append(profile->sites, profile->site_count++, &profile->site_capacity, node->heap_site);
+    }
+    return node;
+}
+
+static ASTNode* parse_expression(Parser* parser);
+
+static Value* number_literal(int n);
+static Value* string_literal(const char* text);
+
+//リテラルの値を作る間の割り当ては、--heap-profileでそのリテラルの位置に数える
+static ASTNode* literal_node(Token* at) {
+    ASTNode* node = ast_new(AST_VALUE, at);
+    current->site_node = node;
+    Value* val = at->type == TOKEN_NUMBER ? number_literal(strtol(at->value, NULL, 10)) : string_literal(at->value);
+    current->site_node = NULL;
+    current->literals = arena_append(current->literals, current->literal_count++, &current->literal_capacity, val);
+    node->data.value = val;
+    return node;
+}
+
+//数のリテラルはすべて一本のnoneのリストの後ろの部分を共有する
+static Value* number_literal(int n) {
+    if (n > current->number_length) {
+        int count = n - current->number_length;
+        //リテラルの分もヒープの上限に数え、評価を始める前に断る
+        size_t bytes = (size_t)count * (sizeof(Value*) + sizeof(unsigned int));
+        size_t max_heap = current->options.max_heap;
+        if (max_heap && current->root->heap_bytes + bytes > max_heap) {
+            parse_fail_memory("number literal #%d exceeds the heap limit of %zu bytes", n, max_heap);
+        }
+        Value** elements = malloc(sizeof(Value*) * count);
+        if (!elements) {
+            parse_fail_memory("out of memory for number literal #%d", n);
+        }
+        for (int i = 0; i < count; i++) {
+            elements[i] = make_none();
+        }
+        Value* longer = make_list(elements, count, current->numbers ? current->numbers : make_nil());
+        free(elements);
+        value_release(current->numbers);
+        current->numbers = longer;
+        current->number_length = n;
+    }
+
+    Value* val = current->numbers ? current->numbers : make_nil();
+    int skip = current->number_length - n;
+    while (skip > 0) {
+        int step = skip < slice_remaining(val) ? skip : slice_remaining(val);
+        val = slice_advance(val, step);
+        skip -= step;
+    }
+    value_retain(val);
+    return val;
+}
+
+static Value* string_literal(const char* text) {
+    int length = strlen(text);
+    Value** elements = malloc(sizeof(Value*) * (length > 0 ? length : 1));
+    for (int i = 0; i < length; i++) {
+        elements[i] = char_encoding((unsigned char)text[i]);
+        value_retain(elements[i]);
+    }
+    Value* val = make_list(elements, length, make_nil());
+    free(elements);
+    return val;
+}
+
+static ASTNode* parse_primary(Parser* parser) {
+    Token* token = current_token(parser);
+    if (!token) {
+        parse_fail("unexpected EOF");
+    }
+
+    switch (token->type) {
+        case TOKEN_NONE: {
+            parser->pos++;
+            ASTNode* node = ast_new(AST_VALUE, token);
+            node->data.value = make_none();
+            return node;
+        }
+        case TOKEN_NIL: {
+            parser->pos++;
+            ASTNode* node = ast_new(AST_VALUE, token);
+            node->data.value = make_nil();
+            return node;
+        }
+        case TOKEN_UNDEFINED: {
+            parser->pos++;
+            ASTNode* node = ast_new(AST_VALUE, token);
+            node->data.value = make_undefined();
+            return node;
+        }
+        case TOKEN_NULL: {
+            parser->pos++;
+            ASTNode* node = ast_new(AST_VALUE, token);
+            node->data.value = make_null();
+            return node;
+        }
+        case TOKEN_PAIR: {
+            parser->pos++;
+            consume(parser, TOKEN_LPAREN);
+            ASTNode* car = parse_expression(parser);
+            consume(parser, TOKEN_COMMA);
+            ASTNode* cdr = parse_expression(parser);
+            consume(parser, TOKEN_RPAREN);
+
+            ASTNode* node = ast_new(AST_PAIR, token);
+            node->data.pair.car = car;
+            node->data.pair.cdr = cdr;
+            node->data.pair.stack = false;
+            return node;
+        }
+        case TOKEN_LIST: {
+            parser->pos++;
+            consume(parser, TOKEN_LPAREN);
+
+            ASTNode** elements = NULL;
+            int count = 0;
+            int capacity = 0;
+
+            while (current_token(parser) && current_token(parser)->type != TOKEN_RPAREN) {
+                ASTNode* element = parse_expression(parser);
+                elements = arena_append(elements, count++, &capacity, element);
+                if (current_token(parser) && current_token(parser)->type == TOKEN_COMMA) {
+                    parser->pos++;
+                }
+            }
+
+            consume(parser, TOKEN_RPAREN);
+
+            ASTNode* node = ast_new(AST_LIST, token);
+            node->data.list.elements = elements;
+            node->data.list.count = count;
+            return node;
+        }
+        case TOKEN_NUMBER: {
+            long n = strtol(token->value, NULL, 10);
+            if (n > INT_MAX) {
+                parse_fail("number literal #%s is too large", token->value);
+            }
+            parser->pos++;
+            return literal_node(token);
+        }
+        case TOKEN_STRING: {
+            parser->pos++;
+            return literal_node(token);
+        }
+        case TOKEN_IDENTIFIER: {
+            char* name = arena_strdup(token->value);
+            parser->pos++;
+
+            ASTNode* node = ast_new(AST_IDENTIFIER, token);
+            node->data.identifier = name;
+            return node;
+        }
+        case TOKEN_LPAREN: {
+            parser->pos++;
+            ASTNode* expr = parse_expression(parser);
+            consume(parser, TOKEN_RPAREN);
+            return expr;
+        }
+        default:
+            parse_fail("unexpected token %d", token->type);
+            return NULL;
+    }
+}
+
+static ASTNode* parse_function_call(Parser* parser) {
+    Token* start = current_token(parser);
+    ASTNode* expr = parse_primary(parser);
+
+    while (current_token(parser) && current_token(parser)->type == TOKEN_LPAREN) {
+        parser->pos++;
+
+        ASTNode** args = NULL;
+        int argc = 0;
+        int capacity = 0;
+
+        while (current_token(parser) && current_token(parser)->type != TOKEN_RPAREN) {
+            ASTNode* arg = parse_expression(parser);
+            args = arena_append(args, argc++, &capacity, arg);
+            if (current_token(parser) && current_token(parser)->type == TOKEN_COMMA) {
+                parser->pos++;
+            }
+        }
+
+        consume(parser, TOKEN_RPAREN);
+
+        ASTNode* call = ast_new(AST_FUNCTION_CALL, start);
+        call->data.call.func = expr;
+        call->data.call.args = args;
+        call->data.call.argc = argc;
+        call->data.call.inlined = NULL;
+        call->data.call.inlined_from = NULL;
+        expr = call;
+    }
+
+    return expr;
+}
+
+static ASTNode* parse_match(Parser* parser) {
+    if (current_token(parser) && current_token(parser)->type == TOKEN_MATCH) {
+        Token* start = current_token(parser);
+        parser->pos++;
+        ASTNode* value = parse_function_call(parser);
+        consume(parser, TOKEN_LBRACE);
+
+        ASTNode** patterns = NULL;
+        ASTNode** bodies = NULL;
+        int case_count = 0;
+        int pattern_capacity = 0;
+        int body_capacity = 0;
+        ASTNode* default_case = NULL;
+
+        while (current_token(parser) &&
+               (current_token(parser)->type == TOKEN_CASE || current_token(parser)->type == TOKEN_DEFAULT)) {
+            if (current_token(parser)->type == TOKEN_CASE) {
+                parser->pos++;
+                ASTNode* pattern = parse_function_call(parser);
+                consume(parser, TOKEN_ARROW);
+                ASTNode* body = parse_expression(parser);
+                patterns = arena_append(patterns, case_count, &pattern_capacity, pattern);
+                bodies = arena_append(bodies, case_count, &body_capacity, body);
+                case_count++;
+            } else if (current_token(parser)->type == TOKEN_DEFAULT) {
+                parser->pos++;
+                consume(parser, TOKEN_ARROW);
+                default_case = parse_expression(parser);
+                break;
+            }
+        }
+
+        consume(parser, TOKEN_RBRACE);
+
+        ASTNode* node = ast_new(AST_MATCH, start);
+        node->data.match.value = value;
+        node->data.match.patterns = patterns;
+        node->data.match.bodies = bodies;
+        node->data.match.case_count = case_count;
+        node->data.match.default_case = default_case;
+        node->data.match.reuse = NULL;
+        return node;
+    }
+
+    return parse_function_call(parser);
+}
+
+static ASTNode* parse_if(Parser* parser) {
+    if (current_token(parser) && current_token(parser)->type == TOKEN_IF) {
+        Token* start = current_token(parser);
+        parser->pos++;
+        ASTNode* condition = parse_match(parser);
+        consume(parser, TOKEN_LBRACE);
+        ASTNode* then_branch = parse_expression(parser);
+        consume(parser, TOKEN_RBRACE);
+
+        ASTNode* else_branch = NULL;
+        if (current_token(parser) && current_token(parser)->type == TOKEN_ELSE) {
+            parser->pos++;
+            consume(parser, TOKEN_LBRACE);
+            else_branch = parse_expression(parser);
+            consume(parser, TOKEN_RBRACE);
+        }
+
+        ASTNode* node = ast_new(AST_IF, start);
+        node->data.if_node.condition = condition;
+        node->data.if_node.then_branch = then_branch;
+        node->data.if_node.else_branch = else_branch;
+        return node;
+    }
+
+    return parse_match(parser);
+}
+
+static ASTNode* parse_expression(Parser* parser) {
+    return parse_if(parser);
+}
+
+static ASTNode* parse_function_def(Parser* parser) {
+    Token* start = consume(parser, TOKEN_FUNCTION);
+    Token* name_token = consume(parser, TOKEN_IDENTIFIER);
+    consume(parser, TOKEN_LPAREN);
+
+    char** params = NULL;
+    int param_count = 0;
+    int capacity = 0;
+
+    while (current_token(parser) && current_token(parser)->type != TOKEN_RPAREN) {
+        Token* param = consume(parser, TOKEN_IDENTIFIER);
+        params = arena_append(params, param_count++, &capacity, arena_strdup(param->value));
+        if (current_token(parser) && current_token(parser)->type == TOKEN_COMMA) {
+            parser->pos++;
+        }
+    }
+
+    consume(parser, TOKEN_RPAREN);
+    consume(parser, TOKEN_LBRACE);
+    ASTNode* body = parse_expression(parser);
+    consume(parser, TOKEN_RBRACE);
+
+    ASTNode* node = ast_new(AST_FUNCTION_DEF, start);
+    node->data.func_def.name = arena_strdup(name_token->value);
+    node->data.func_def.params = params;
+    node->data.func_def.param_count = param_count;
+    node->data.func_def.body = body;
+    node->data.func_def.pure = false;
+    node->data.func_def.cse_slots = 0;
+    return node;
+}
+
+static ASTNode* parse_statement(Parser* parser) {
+    Token* token = current_token(parser);
+    if (token && token->type == TOKEN_FUNCTION) {
+        return parse_function_def(parser);
+    }
+    return parse_expression(parser);
+}
+
+static Value* evaluate(ASTNode* node, Environment* env);
+
+static bool values_equal(Value* a, Value* b) {
+    while (true) {
+        if (value_type(a) != value_type(b)) return false;
+
+        switch (value_type(a)) {
+            case VAL_NONE:
+            case VAL_NIL:
+            case VAL_UNDEFINED:
+            case VAL_NULL:
+                return true;
+            case VAL_PAIR: {
+                if (a == b) return true;
+                unsigned int a_hash = value_hash(a);
+                unsigned int b_hash = value_hash(b);
+                if (a_hash && b_hash && a_hash != b_hash) return false;
+
+                //両方ブロック上なら連続した要素をまとめて比べる
+                if (IS_SLICE(a) && IS_SLICE(b)) {
+                    int n = slice_remaining(a) < slice_remaining(b) ? slice_remaining(a) : slice_remaining(b);
+                    Value** a_elements = SLICE_CHUNK(a)->elements + SLICE_INDEX(a);
+                    Value** b_elements = SLICE_CHUNK(b)->elements + SLICE_INDEX(b);
+                    for (int i = 0; i < n; i++) {
+                        if (a_elements[i] != b_elements[i] && !values_equal(a_elements[i], b_elements[i])) return false;
+                    }
+                    a = slice_advance(a, n);
+                    b = slice_advance(b, n);
+                    break;
+                }
+
+                if (!values_equal(pair_car(a), pair_car(b))) return false;
+                a = pair_cdr(a);
+                b = pair_cdr(b);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+}
+
+static int encoding_to_number(Value* encoded) {
+    int count = 0;
+    Value* current = encoded;
+
+    while (current != NULL) {
+        if (value_type(current) == VAL_NIL) {
+            return count;
+        }
+        if (value_type(current) == VAL_PAIR && value_type(pair_car(current)) == VAL_NONE) {
+            count++;
+            current = pair_cdr(current);
+        } else {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+//純粋関数の結果キャッシュ (--memo)
+static unsigned long memo_hash(Value* func, Value** args, int argc) {
+    unsigned long hash = (unsigned long)func;
+    for (int i = 0; i < argc; i++) {
+        hash = hash * 131 + value_hash(args[i]);
+    }
+    return hash;
+}
+
+static void memo_unlink(MemoEntry* entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else current->memo.lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else current->memo.lru_tail = entry->lru_prev;
+}
+
+static void memo_push_front(MemoEntry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = current->memo.lru_head;
+    if (current->memo.lru_head) current->memo.lru_head->lru_prev = entry;
+    current->memo.lru_head = entry;
+    if (!current->memo.lru_tail) current->memo.lru_tail = entry;
+}
+
+static void memo_entry_free(MemoEntry* entry) {
+    value_release(entry->func);
+    for (int i = 0; i < entry->argc; i++) {
+        value_release(entry->args[i]);
+    }
+    free(entry->args);
+    value_release(entry->result);
+    free(entry);
+}
+
+static Value* memo_lookup(Value* func, Value** args, int argc) {
+    if (!current->memo.buckets) {
+        current->memo.misses++;
+        return NULL;
+    }
+
+    unsigned long hash = memo_hash(func, args, argc);
+    for (MemoEntry* entry = current->memo.buckets[hash & (current->memo.bucket_count - 1)]; entry; entry = entry->bucket_next) {
+        if (entry->hash != hash || entry->func != func || entry->argc != argc) continue;
+
+        bool same = true;
+        for (int i = 0; i < argc && same; i++) {
+            same = values_equal(entry->args[i], args[i]);
+        }
+        if (!same) continue;
+
+        memo_unlink(entry);
+        memo_push_front(entry);
+        current->memo.hits++;
+        value_retain(entry->result);
+        return entry->result;
+    }
+
+    current->memo.misses++;
+    return NULL;
+}
+
+static void memo_evict(void) {
+    MemoEntry* victim = current->memo.lru_tail;
+    memo_unlink(victim);
+
+    MemoEntry** link = &current->memo.buckets[victim->hash & (current->memo.bucket_count - 1)];
+    while (*link != victim) {
+        link = &(*link)->bucket_next;
+    }
+    *link = victim->bucket_next;
+
+    memo_entry_free(victim);
+    current->memo.size--;
+    current->memo.evictions++;
+}
+
+static void memo_store(Value* func, Value** args, int argc, Value* result) {
+    if (current->options.memo_size <= 0) return;
+
+    if (!current->memo.buckets) {
+        current->memo.bucket_count = 1;
+        while (current->memo.bucket_count < current->options.memo_size) {
+            current->memo.bucket_count <<= 1;
+        }
+        current->memo.buckets = calloc(current->memo.bucket_count, sizeof(MemoEntry*));
+    }
+    if (current->memo.size >= current->options.memo_size) {
+        memo_evict();
+    }
+
+    MemoEntry* entry = malloc(sizeof(MemoEntry));
+    entry->func = func;
+    entry->args = malloc(sizeof(Value*) * (argc > 0 ? argc : 1));
+    entry->argc = argc;
+    entry->hash = memo_hash(func, args, argc);
+    entry->result = result;
+    value_retain(func);
+    for (int i = 0; i < argc; i++) {
+        entry->args[i] = args[i];
+        value_retain(args[i]);
+    }
+    value_retain(result);
+
+    MemoEntry** bucket = &current->memo.buckets[entry->hash & (current->memo.bucket_count - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    memo_push_front(entry);
+    current->memo.size++;
+}
+
+static void memo_clear(void) {
+    MemoEntry* entry = current->memo.lru_head;
+    while (entry) {
+        MemoEntry* next = entry->lru_next;
+        memo_entry_free(entry);
+        entry = next;
+    }
+    free(current->memo.buckets);
+    memset(&current->memo, 0, sizeof(current->memo));
+}
+
+
+static Value* builtin_eq(Value** args, int argc, Environment* env) {
+    if (argc != 2) {
+        return fail(NS_ERR_RUNTIME, "eq requires 2 arguments");
+    }
+
+    return values_equal(args[0], args[1]) ? make_nil() : make_undefined();
+}
+
+static Value* builtin_car(Value** args, int argc, Environment* env) {
+    if (argc != 1) {
+        return fail(NS_ERR_RUNTIME, "car requires 1 arguments");
+    }
+
+    if (value_type(args[0]) != VAL_PAIR) {
+        return fail(NS_ERR_RUNTIME, "car needs a pair");
+    }
+
+    Value* car = pair_car(args[0]);
+    value_retain(car);
+    return car;
+}
+
+static Value* builtin_cdr(Value** args, int argc, Environment* env) {
+    if (argc != 1) {
+        return fail(NS_ERR_RUNTIME, "cdr requires 1 argument");
+    }
+
+    if (value_type(args[0]) != VAL_PAIR) {
+        return fail(NS_ERR_RUNTIME, "cdr needs a pair");
+    }
+
+    Value* cdr = pair_cdr(args[0]);
+    value_retain(cdr);
+    return cdr;
+}
+
+static Value* builtin_print(Value** args, int argc, Environment* env) {
+    if (argc != 1) {
+        return fail(NS_ERR_RUNTIME, "print requires 1 pair argument");
+    }
+
+    Value* arg = args[0];
+    if (value_type(arg) != VAL_PAIR) {
+        return fail(NS_ERR_RUNTIME, "print needs a pair");
+    }
+
+    Value* format_type = pair_car(arg);
+    Value* value = pair_cdr(arg);
+    //futureから同時に呼ばれても1回分の出力は混ざらない
+    flockfile(current->options.output);
+
+    if (value_type(format_type) == VAL_NONE) {
+        int num = encoding_to_number(value);
+        if (num >= 0) {
+            fprintf(current->options.output, "%d", num);
+        }
+    }
+    else if (value_type(format_type) == VAL_UNDEFINED) {
+        int ascii = encoding_to_number(value);
+        if (ascii >= 0 && ascii <= 127) {
+            fputc(ascii, current->options.output);
+        }
+    }
+    else if (value_type(format_type) == VAL_NULL) {
+        switch (value_type(value)) {
+            case VAL_NONE: fputs("none", current->options.output); break;
+            case VAL_NIL: fputs("nil", current->options.output); break;
+            case VAL_UNDEFINED: fputs("undefined", current->options.output); break;
+            case VAL_NULL: fputs("null", current->options.output); break;
+            case VAL_PAIR: fputs("pair(...)", current->options.output); break;
+            case VAL_FUTURE: fputs("future", current->options.output); break;
+            default: fputs("unknown", current->options.output); break;
+        }
+    }
+
+    fflush(current->options.output);
+    funlockfile(current->options.output);
+    return make_nil();
+}
+
+//引数の参照を残さない組み込み関数。その場で作った引数のペアは呼び出しの後に捨てられる
+static bool builtin_keeps_no_args(Value* func) {
+    NsBuiltin impl = AS_BUILTIN(func)->func;
+    return impl == builtin_print || impl == builtin_eq || impl == builtin_car || impl == builtin_cdr;
+}
+
+static Value* builtin_read_file(Value** args, int argc, Environment* env) {
+    (void)env;
+    if (argc != 1) {
+        return fail(NS_ERR_RUNTIME, "read_file requires 1 argument");
+    }
+
+    //パスは文字エンコーディングのリスト
+    char path[4096];
+    int length = 0;
+    Value* current = args[0];
+    while (value_type(current) == VAL_PAIR) {
+        if (length == (int)sizeof(path) - 1) {
+            return fail(NS_ERR_RUNTIME, "read_file path is longer than %d characters", length);
+        }
+        int c = encoding_to_number(pair_car(current));
+        if (c <= 0 || c > 255) {
+            return fail(NS_ERR_RUNTIME, "read_file needs a list of characters");
+        }
+        path[length++] = (char)c;
+        current = pair_cdr(current);
+    }
+    path[length] = '\0';
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return fail(NS_ERR_RUNTIME, "cannot open file %s", path);
+    }
+
+    bool mapped;
+    Value* result = stream_from_fd(fd, &mapped);
+    close(fd);
+    if (!mapped) {
+        return fail(NS_ERR_RUNTIME, "cannot map file %s", path);
+    }
+    return result;
+}
+
+static Value* builtin_stdin(Value** args, int argc, Environment* env) {
+    (void)args;
+    (void)env;
+    if (argc != 0) {
+        return fail(NS_ERR_RUNTIME, "stdin requires no arguments");
+    }
+
+    bool mapped;
+    Value* result = stream_from_fd(STDIN_FILENO, &mapped);
+    if (mapped) return result;
+
+    //パイプなどは1文字先読みしながら読む
+    int c = getc(stdin);
+    if (c == EOF) return make_nil();
+
+    InputSource* source = source_new();
+    source->file = stdin;
+    result = stream_new(source, (size_t)c);
+    source_release(source);
+    return result;
+}
+
+//future
+
+//プールはプロセスに一つ。各スレッドは自分のキューの末尾から取り、空なら他のキューの先頭から盗む
+//最後のキューはプール外のスレッドが積む
+typedef struct {
+    pthread_mutex_t lock;
+    Value** tasks;
+    int head;
+    int count;
+    int capacity;
+} TaskQueue;
+
+typedef struct {
+    TaskQueue* queues;
+    int worker_count;
+    int queued;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+} Pool;
+
+static Pool pool;
+static pthread_mutex_t pool_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int pool_index = -1;
+
+static void job_yield(void);
+
+static void stats_merge(Stats* into, Stats* from) {
+    into->value_new += from->value_new;
+    into->value_reuse += from->value_reuse;
+    into->value_stack += from->value_stack;
+    into->value_retain += from->value_retain;
+    into->value_release += from->value_release;
+    into->value_free += from->value_free;
+    into->env_new += from->env_new;
+    into->live_values += from->live_values;
+    into->live_envs += from->live_envs;
+    if (from->peak_values > into->peak_values) into->peak_values = from->peak_values;
+    if (from->peak_envs > into->peak_envs) into->peak_envs = from->peak_envs;
+    if (from->peak_depth > into->peak_depth) into->peak_depth = from->peak_depth;
+    for (int i = 0; i <= AST_CSE; i++) {
+        into->nodes[i] += from->nodes[i];
+    }
+}
+
+//rootと環境や上限を共有し、カウンタとエラーだけ別に持つ
+static NsInterp* shadow_new(NsInterp* root) {
+    NsInterp* ns = calloc(1, sizeof(NsInterp));
+    ns->options = root->options;
+    ns->options.memo = false;
+    ns->globals = root->globals;
+    memcpy(ns->char_encodings, root->char_encodings, sizeof(ns->char_encodings));
+    ns->purity_stale = root->purity_stale;
+    ns->running = true;
+    ns->root = root;
+    ns->parallel = true;
+    return ns;
+}
+
+static void shadow_free(NsInterp* ns) {
+    reuse_flush();
+    pthread_mutex_lock(&ns->root->task_lock);
+    stats_merge(&ns->root->task_stats, &ns->stats);
+    pthread_mutex_unlock(&ns->root->task_lock);
+    free(ns->region);
+    free(ns);
+}
+
+static void pool_notify_done(void) {
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static Value* call_value(Value* func, Value** args, int argc) {
+    if (value_type(func) == VAL_BUILTIN) {
+        Value* result = AS_BUILTIN(func)->func(args, argc, current->globals);
+        if (result && current->status != NS_OK) {
+            value_release(result);
+            result = NULL;
+        }
+        return result;
+    }
+
+    Function* fn = AS_FUNCTION(func);
+    if (argc != fn->param_count) {
+        return fail(NS_ERR_RUNTIME, "argument count mismatch");
+    }
+    Environment* call_env = call_env_new(fn);
+    for (int i = 0; i < argc; i++) {
+        env_define(call_env, fn->params[i], args[i]);
+    }
+    Value* result = evaluate(fn->body, call_env);
+    env_release(call_env);
+    return result;
+}
+
+//まだ誰も始めていなければ、今のスレッドの影のインタプリタで評価する
+static void future_execute(Future* future) {
+    int expected = FUTURE_QUEUED;
+    if (!__atomic_compare_exchange_n(&future->state, &expected, FUTURE_RUNNING, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    NsInterp* saved = current;
+    NsInterp* ns = shadow_new(future->root);
+    current = ns;
+    future->result = call_value(future->func, future->args, future->argc);
+    future->status = ns->status;
+    if (ns->status != NS_OK) {
+        future->error = strdup(ns->error);
+    }
+    shadow_free(ns);
+    current = saved;
+
+    __atomic_store_n(&future->state, FUTURE_DONE, __ATOMIC_RELEASE);
+    pool_notify_done();
+}
+
+static void queue_push(TaskQueue* queue, Value* task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        Value** tasks = malloc(sizeof(Value*) * capacity);
+        for (int i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static Value* queue_take(TaskQueue* queue, bool steal) {
+    pthread_mutex_lock(&queue->lock);
+    Value* task = NULL;
+    if (queue->count > 0) {
+        queue->count--;
+        if (steal) {
+            task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        } else {
+            task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+static Value* pool_take(void) {
+    if (__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) == 0) return NULL;
+
+    int queue_count = pool.worker_count + 1;
+    int own = pool_index >= 0 ? pool_index : pool.worker_count;
+    Value* task = queue_take(&pool.queues[own], pool_index < 0);
+    for (int i = 1; !task && i < queue_count; i++) {
+        task = queue_take(&pool.queues[(own + i) % queue_count], true);
+    }
+    if (task) __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+    return task;
+}
+
+//キューから取ったfutureを評価し、キューの持っていた参照を返す
+static void pool_run(Value* task) {
+    NsInterp* root = AS_FUTURE(task)->root;
+    future_execute(AS_FUTURE(task));
+
+    NsInterp* saved = current;
+    NsInterp* ns = shadow_new(root);
+    current = ns;
+    value_release(task);
+    shadow_free(ns);
+    current = saved;
+
+    __atomic_sub_fetch(&root->pending_tasks, 1, __ATOMIC_ACQ_REL);
+    pool_notify_done();
+}
+
+static void* pool_worker(void* arg) {
+    pool_index = (int)(intptr_t)arg;
+    while (true) {
+        Value* task = pool_take();
+        if (task) {
+            pool_run(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        while (__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+static void pool_start(int threads) {
+    pthread_mutex_lock(&pool_start_lock);
+    if (!pool.queues) {
+        int count = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (count < 1) count = 1;
+        pool.worker_count = count;
+        pool.queues = calloc(count + 1, sizeof(TaskQueue));
+        for (int i = 0; i <= count; i++) {
+            pthread_mutex_init(&pool.queues[i].lock, NULL);
+        }
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.wake, NULL);
+        pthread_cond_init(&pool.done, NULL);
+
+        for (int i = 0; i < count; i++) {
+            pthread_t thread;
+            pthread_create(&thread, NULL, pool_worker, (void*)(intptr_t)i);
+            pthread_detach(thread);
+        }
+    }
+    pthread_mutex_unlock(&pool_start_lock);
+}
+
+static void pool_push(Value* task) {
+    int own = pool_index >= 0 ? pool_index : pool.worker_count;
+    queue_push(&pool.queues[own], task);
+    __atomic_add_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+//doneが真になるまで、他のfutureを手伝うか待つ
+static void pool_wait(bool (*done)(void*), void* arg) {
+    while (!done(arg)) {
+        Value* task = pool_take();
+        if (task) {
+            pool_run(task);
+            continue;
+        }
+        if (current->job) {
+            job_yield();
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        while (!done(arg) && __atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static bool future_done(void* arg) {
+    return __atomic_load_n(&AS_FUTURE(arg)->state, __ATOMIC_ACQUIRE) == FUTURE_DONE;
+}
+
+static bool tasks_done(void* arg) {
+    return __atomic_load_n(&((NsInterp*)arg)->pending_tasks, __ATOMIC_ACQUIRE) == 0;
+}
+
+//最初のfutureの前に、共有される値の参照カウントをアトミックに切り替える
+static void parallel_begin(void) {
+    NsInterp* root = current->root;
+    if (!root->parallel) {
+        char_encoding(0);
+        root->parallel = true;
+    }
+    pool_start(root->options.future_threads);
+}
+
+static Value* builtin_future(Value** args, int argc, Environment* env) {
+    (void)env;
+    if (argc < 1 || (value_type(args[0]) != VAL_FUNCTION && value_type(args[0]) != VAL_BUILTIN)) {
+        return fail(NS_ERR_RUNTIME, "future requires a function");
+    }
+    parallel_begin();
+
+    Value* val = value_new(VAL_FUTURE, sizeof(Future));
+    Future* future = AS_FUTURE(val);
+    future->root = current->root;
+    future->func = args[0];
+    value_retain(future->func);
+    future->argc = argc - 1;
+    future->args = malloc(sizeof(Value*) * (argc > 1 ? argc - 1 : 1));
+    for (int i = 1; i < argc; i++) {
+        future->args[i - 1] = args[i];
+        value_retain(args[i]);
+    }
+    future->state = FUTURE_QUEUED;
+    future->result = NULL;
+    future->status = NS_OK;
+    future->error = NULL;
+
+    value_retain(val);
+    __atomic_add_fetch(&future->root->pending_tasks, 1, __ATOMIC_ACQ_REL);
+    pool_push(val);
+    return val;
+}
+
+//future以外はそのまま返す
+static Value* builtin_touch(Value** args, int argc, Environment* env) {
+    (void)env;
+    if (argc != 1) {
+        return fail(NS_ERR_RUNTIME, "touch requires 1 argument");
+    }
+    if (value_type(args[0]) != VAL_FUTURE) {
+        value_retain(args[0]);
+        return args[0];
+    }
+
+    Future* future = AS_FUTURE(args[0]);
+    future_execute(future);
+    pool_wait(future_done, future);
+
+    if (future->status != NS_OK) {
+        return fail(future->status, "%s", future->error);
+    }
+    value_retain(future->result);
+    return future->result;
+}
+
+static Value* make_builtin(const char* name, Value* (*func)(Value**, int, Environment*)) {
+    Value* val = value_new(VAL_BUILTIN, sizeof(Builtin));
+    AS_BUILTIN(val)->name = strdup(name);
+    AS_BUILTIN(val)->func = func;
+    return val;
+}
+
+static void define_builtin(Environment* env, const char* name, NsBuiltin func) {
+    Value* builtin = make_builtin(name, func);
+    env_define(env, name, builtin);
+    value_release(builtin);
+}
+
+static void setup_minimal_builtins(Environment* env) {
+    define_builtin(env, "eq", builtin_eq);
+    define_builtin(env, "car", builtin_car);
+    define_builtin(env, "cdr", builtin_cdr);
+    define_builtin(env, "print", builtin_print);
+    define_builtin(env, "read_file", builtin_read_file);
+    define_builtin(env, "stdin", builtin_stdin);
+    define_builtin(env, "future", builtin_future);
+    define_builtin(env, "touch", builtin_touch);
+}
+
+static bool match_pattern(ASTNode* pattern, Value* value, Environment* env) {
+    if (pattern->type == AST_VALUE) {
+        return values_equal(pattern->data.value, value);
+    } else if (pattern->type == AST_IDENTIFIER) {
+        if (strcmp(pattern->data.identifier, "_") == 0) {
+            return true;
+        }
+        env_define(env, pattern->data.identifier, value);
+        return true;
+    } else if (pattern->type == AST_PAIR) {
+        if (value_type(value) == VAL_PAIR) {
+            return match_pattern(pattern->data.pair.car, pair_car(value), env) &&
+                   match_pattern(pattern->data.pair.cdr, pair_cdr(value), env);
+        }
+        return false;
+    } else {
+        //評価に失敗した場合はfalseを返し、呼び出し元がstatusを見る
+        Value* pattern_value = evaluate(pattern, env);
+        if (!pattern_value) return false;
+        bool result = values_equal(pattern_value, value);
+        value_release(pattern_value);
+        return result;
+    }
+}
+
+//識別子の値はenvが持っているので、参照を増やさずに借りる
+static Value* evaluate_borrowed(ASTNode* node, Environment* env) {
+    if (current->options.stats) current->stats.nodes[AST_IDENTIFIER]++;
+    Value* val = env_lookup(env, node->data.identifier);
+    if (!val) {
+        return fail(NS_ERR_RUNTIME, "undefined variable %s", node->data.identifier);
+    }
+    return val;
+}
+
+static long fuel_use(void) {
+    NsInterp* root = current->root;
+    if (current->parallel) return __atomic_add_fetch(&root->fuel_used, 1, __ATOMIC_RELAXED);
+    return ++root->fuel_used;
+}
+
+//タイムスライスを使い切ったらワーカーに戻る。再開はこの関数の中から
+static void job_yield(void) {
+    NsInterp* ns = current;
+    ns->slice_used = 0;
+    swapcontext(&ns->job->context, &worker_self->context);
+    current = ns;
+}
+
+static Value* evaluate_node(ASTNode* node, Environment* env) {
+    //末尾位置の式はCのスタックを積まずにループで評価する
+    //ownedはこのループで作った環境で、次の末尾呼び出しか終了時に解放する
+    Environment* owned = NULL;
+    Value* result = NULL;
+    NsOptions* options = &current->options;
+
+    //continueで来たノードは末尾位置。tailは2周目から立つ
+    for (bool tail = false;; tail = true) {
+        if (options->stats) current->stats.nodes[node->type]++;
+        current->site_node = node;
+
+        if (options->fuel && fuel_use() > options->fuel) {
+            fail(NS_ERR_FUEL, "out of fuel after %ld steps", options->fuel);
+            break;
+        }
+        if (options->max_heap && current->root->heap_bytes > options->max_heap) {
+            fail(NS_ERR_MEMORY, "heap limit of %zu bytes exceeded", options->max_heap);
+            break;
+        }
+        if (current->job && ++current->slice_used >= current->job->slice) {
+            job_yield();
+        }
+
+        switch (node->type) {
+            case AST_VALUE:
+                value_retain(node->data.value);
+                result = node->data.value;
+                break;
+
+            case AST_IDENTIFIER: {
+                Value* val = env_lookup(env, node->data.identifier);
+                if (!val) {
+                    fail(NS_ERR_RUNTIME, "undefined variable %s", node->data.identifier);
+                    break;
+                }
+                value_retain(val);
+                result = val;
+                break;
+            }
+
+            case AST_PAIR: {
+                //子の評価より先に取り出す。子の中のペアはヒープに作る
+                bool to_region = current->region_request == node;
+                current->region_request = NULL;
+                Value* car = evaluate(node->data.pair.car, env);
+                if (!car) break;
+                Value* cdr = evaluate(node->data.pair.cdr, env);
+                if (!cdr) {
+                    value_release(car);
+                    break;
+                }
+                if (to_region && (result = region_pair(car, cdr))) break;
+                result = make_pair(car, cdr);
+                value_release(car);
+                value_release(cdr);
+                break;
+            }
+
+            case AST_LIST: {
+                int count = node->data.list.count;
+                Value** elements = malloc(sizeof(Value*) * (count > 0 ? count : 1));
+                int evaluated = 0;
+                while (evaluated < count) {
+                    elements[evaluated] = evaluate(node->data.list.elements[evaluated], env);
+                    if (!elements[evaluated]) break;
+                    evaluated++;
+                }
+                if (evaluated == count) {
+                    result = make_list(elements, count, make_nil());
+                } else {
+                    for (int i = 0; i < evaluated; i++) {
+                        value_release(elements[i]);
+                    }
+                }
+                free(elements);
+                break;
+            }
+
+            case AST_FUNCTION_DEF: {
+                Value* func = value_new(VAL_FUNCTION, sizeof(Function));
+                Function* fn = AS_FUNCTION(func);
+                fn->name = strdup(node->data.func_def.name);
+                fn->params = malloc(sizeof(char*) * node->data.func_def.param_count);
+                for (int i = 0; i < node->data.func_def.param_count; i++) {
+                    fn->params[i] = strdup(node->data.func_def.params[i]);
+                }
+                fn->param_count = node->data.func_def.param_count;
+                fn->body = node->data.func_def.body;
+                //関数はグローバル環境に束縛されるので、環境を所有すると循環参照になる
+                fn->closure = env;
+                fn->cse_slots = node->data.func_def.cse_slots;
+                fn->pure = node->data.func_def.pure;
+
+                env_define(env, node->data.func_def.name, func);
+                result = func;
+                break;
+            }
+
+            case AST_FUNCTION_CALL: {
+                //定義より前の呼び出しや、名前が別の値に束縛されている時は普通に呼ぶ
+                Value* callee = node->data.call.inlined && !current->purity_stale ?
+                    env_lookup(env, node->data.call.func->data.identifier) : NULL;
+                if (callee && value_type(callee) == VAL_FUNCTION &&
+                    AS_FUNCTION(callee)->body == node->data.call.inlined_from) {
+                    //展開した呼び出しは呼び出しとして数えない
+                    if (options->stats) current->stats.nodes[AST_FUNCTION_CALL]--;
+                    node = node->data.call.inlined;
+                    continue;
+                }
+                Value* func = evaluate(node->data.call.func, env);
+                if (!func) break;
+                int argc = node->data.call.argc;
+                //組み込み関数は引数を借りるだけなので、識別子は参照を増やさずに渡す
+                bool borrow = value_type(func) == VAL_BUILTIN;
+                bool region = borrow && builtin_keeps_no_args(func);
+                int region_mark = current->region_used;
+
+                Value** args = malloc(sizeof(Value*) * (argc > 0 ? argc : 1));
+                int evaluated = 0;
+                while (evaluated < argc) {
+                    ASTNode* arg = node->data.call.args[evaluated];
+                    if (borrow && arg->type == AST_IDENTIFIER) {
+                        args[evaluated] = evaluate_borrowed(arg, env);
+                    } else {
+                        if (region && arg->type == AST_PAIR && arg->data.pair.stack) {
+                            current->region_request = arg;
+                        }
+                        args[evaluated] = evaluate(arg, env);
+                        current->region_request = NULL;
+                    }
+                    if (!args[evaluated]) break;
+                    evaluated++;
+                }
+
+                Environment* call_env = NULL;
+                bool moved = false;
+                result = NULL;
+
+                if (evaluated < argc) {
+                    //引数の評価に失敗した
+                } else if (value_type(func) == VAL_BUILTIN) {
+                    result = AS_BUILTIN(func)->func(args, argc, env);
+                    if (result && current->status != NS_OK) {
+                        value_release(result);
+                        result = NULL;
+                    }
+                } else if (value_type(func) == VAL_FUNCTION) {
+                    Function* fn = AS_FUNCTION(func);
+                    //末尾呼び出しをキャッシュすると戻る必要があってCのスタックを積むので、ループのままにする
+                    bool memoize = options->memo && fn->pure && !current->purity_stale && !tail;
+
+                    if (argc != fn->param_count) {
+                        fail(NS_ERR_RUNTIME, "argument count mismatch");
+                    } else {
+                        if (memoize) {
+                            result = memo_lookup(func, args, argc);
+                        }
+
+                        if (!result) {
+                            call_env = call_env_new(fn);
+                            //引数の参照はそのまま呼び出し先の環境に移す
+                            //キャッシュする時は後でargsを使うので、本体に使い回されないよう参照を残す
+                            for (int i = 0; i < argc; i++) {
+                                if (memoize) {
+                                    env_define(call_env, fn->params[i], args[i]);
+                                } else {
+                                    env_bind(call_env, fn->params[i], args[i]);
+                                }
+                            }
+                            moved = !memoize;
+
+                            //結果をキャッシュする時だけは戻ってくる必要がある
+                            if (memoize) {
+                                result = evaluate(fn->body, call_env);
+                                if (result) {
+                                    memo_store(func, args, argc, result);
+                                }
+                                env_release(call_env);
+                                call_env = NULL;
+                            }
+                        }
+                    }
+                } else {
+                    fail(NS_ERR_RUNTIME, "uncallable object");
+                }
+
+                for (int i = 0; i < evaluated && !moved; i++) {
+                    if (!(borrow && node->data.call.args[i]->type == AST_IDENTIFIER) && !in_region(args[i])) {
+                        value_release(args[i]);
+                    }
+                }
+                free(args);
+                region_reset(region_mark);
+
+                if (call_env) {
+                    node = AS_FUNCTION(func)->body;
+                    value_release(func);
+                    env_release(owned);
+                    owned = env = call_env;
+                    continue;
+                }
+                value_release(func);
+                break;
+            }
+
+            case AST_IF: {
+                Value* condition = evaluate(node->data.if_node.condition, env);
+                if (!condition) break;
+                bool is_true = (value_type(condition) == VAL_NIL);
+                value_release(condition);
+
+                if (is_true) {
+                    node = node->data.if_node.then_branch;
+                    continue;
+                } else if (node->data.if_node.else_branch) {
+                    node = node->data.if_node.else_branch;
+                    continue;
+                }
+                result = make_nil();
+                break;
+            }
+
+            case AST_MATCH: {
+                ASTNode* scrutinee = node->data.match.value;
+                bool borrowed = scrutinee->type == AST_IDENTIFIER;
+                int region_mark = current->region_used;
+                if (scrutinee->type == AST_PAIR && scrutinee->data.pair.stack) {
+                    current->region_request = scrutinee;
+                }
+                Value* value = borrowed ? evaluate_borrowed(scrutinee, env) : evaluate(scrutinee, env);
+                current->region_request = NULL;
+                if (!value) break;
+
+                Environment* match_env = NULL;
+                ASTNode* body = NULL;
+                int matched = -1;
+                for (int i = 0; i < node->data.match.case_count; i++) {
+                    match_env = env_new(env);
+                    if (match_pattern(node->data.match.patterns[i], value, match_env)) {
+                        body = node->data.match.bodies[i];
+                        matched = i;
+                        break;
+                    }
+                    env_release(match_env);
+                    match_env = NULL;
+                    if (current->status != NS_OK) break;
+                }
+
+                //この枝で変数がもう使われず、ペアを持っているのが変数だけならセルを使い回す
+                if (body && borrowed && node->data.match.reuse && node->data.match.reuse[matched] &&
+                    !IS_IMMEDIATE(value) && !IS_SLICE(value) &&
+                    value->type == VAL_PAIR && ref_load(&value->ref_count) == 1) {
+                    EnvironmentEntry* entry = env_find(env, scrutinee->data.identifier);
+                    entry->value = make_none();
+                    pair_drop_reuse(value);
+                } else if (!borrowed && !in_region(value)) {
+                    value_release(value);
+                }
+                region_reset(region_mark);
+
+                if (current->status != NS_OK) {
+                    env_release(match_env);
+                    break;
+                }
+                if (body) {
+                    env_release(owned);
+                    owned = env = match_env;
+                    node = body;
+                    continue;
+                }
+                if (node->data.match.default_case) {
+                    node = node->data.match.default_case;
+                    continue;
+                }
+
+                fail(NS_ERR_RUNTIME, "pattern matching failure");
+                break;
+            }
+
+            case AST_CSE: {
+                //最初に評価した値を呼び出しフレームに残して使い回す
+                Environment* frame = env;
+                while (frame && !frame->cse_values) {
+                    frame = frame->parent;
+                }
+                if (!frame || current->purity_stale) {
+                    result = evaluate(node->data.cse.expr, env);
+                    break;
+                }
+
+                Value** slot = &frame->cse_values[node->data.cse.slot];
+                if (!*slot) {
+                    *slot = evaluate(node->data.cse.expr, env);
+                    if (!*slot) break;
+                }
+                value_retain(*slot);
+                result = *slot;
+                break;
+            }
+
+            default:
+                fail(NS_ERR_RUNTIME, "unimplemented AST node");
+                break;
+        }
+        break;
+    }
+
+    env_release(owned);
+    return result;
+}
+
+static Value* evaluate(ASTNode* node, Environment* env) {
+    int max_depth = current->options.max_depth;
+    if (max_depth && current->stats.depth >= max_depth) {
+        return fail(NS_ERR_DEPTH, "recursion depth limit of %d exceeded", max_depth);
+    }
+
+    //深さは--max-depthにも使うので常に数える
+    if (++current->stats.depth > current->stats.peak_depth && current->options.stats) {
+        current->stats.peak_depth = current->stats.depth;
+    }
+    ASTNode* site_node = current->site_node;
+    Value* result = evaluate_node(node, env);
+    current->site_node = site_node;
+    current->stats.depth--;
+    return result;
+}
+
+//最適化
+
+typedef struct {
+    char** names;
+    int count;
+    int capacity;
+} NameList;
+
+typedef struct {
+    ASTNode*** sites;
+    int count;
+    int capacity;
+} SiteList;
+
+static FunctionInfo* find_function(ProgramInfo* info, const char* name) {
+    for (int i = 0; i < info->count; i++) {
+        if (strcmp(info->funcs[i].name, name) == 0) {
+            return &info->funcs[i];
+        }
+    }
+    return NULL;
+}
+
+static bool is_pure_builtin(const char* name) {
+    return strcmp(name, "eq") == 0 || strcmp(name, "car") == 0 || strcmp(name, "cdr") == 0;
+}
+
+static void name_list_add(NameList* list, char* name) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 8;
+        list->names = realloc(list->names, sizeof(char*) * list->capacity);
+    }
+    list->names[list->count++] = name;
+}
+
+static bool name_list_contains(NameList* list, const char* name) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->names[i], name) == 0) return true;
+    }
+    return false;
+}
+
+static void collect_pattern_names(ASTNode* pattern, NameList* out) {
+    if (pattern->type == AST_IDENTIFIER) {
+        if (strcmp(pattern->data.identifier, "_") != 0) {
+            name_list_add(out, pattern->data.identifier);
+        }
+    } else if (pattern->type == AST_PAIR) {
+        collect_pattern_names(pattern->data.pair.car, out);
+        collect_pattern_names(pattern->data.pair.cdr, out);
+    }
+}
+
+//matchで束縛される名前を全部集める
+static void collect_bound_names(ASTNode* node, NameList* out) {
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_PAIR:
+            collect_bound_names(node->data.pair.car, out);
+            collect_bound_names(node->data.pair.cdr, out);
+            break;
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                collect_bound_names(node->data.list.elements[i], out);
+            }
+            break;
+        case AST_FUNCTION_CALL:
+            collect_bound_names(node->data.call.func, out);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                collect_bound_names(node->data.call.args[i], out);
+            }
+            collect_bound_names(node->data.call.inlined, out);
+            break;
+        case AST_IF:
+            collect_bound_names(node->data.if_node.condition, out);
+            collect_bound_names(node->data.if_node.then_branch, out);
+            collect_bound_names(node->data.if_node.else_branch, out);
+            break;
+        case AST_MATCH:
+            collect_bound_names(node->data.match.value, out);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                collect_pattern_names(node->data.match.patterns[i], out);
+                collect_bound_names(node->data.match.bodies[i], out);
+            }
+            collect_bound_names(node->data.match.default_case, out);
+            break;
+        case AST_CSE:
+            collect_bound_names(node->data.cse.expr, out);
+            break;
+        default:
+            break;
+    }
+}
+
+static bool is_pure_callee(ASTNode* callee, ProgramInfo* info, NameList* locals) {
+    if (callee->type != AST_IDENTIFIER) return false;
+
+    const char* name = callee->data.identifier;
+    if (name_list_contains(locals, name)) return false;
+
+    FunctionInfo* func = find_function(info, name);
+    if (func) {
+        return func->def_count == 1 && func->def->data.func_def.pure;
+    }
+    return is_pure_builtin(name);
+}
+
+//printに届く呼び出しがあれば不純
+static bool is_pure_expression(ASTNode* node, ProgramInfo* info, NameList* locals) {
+    if (!node) return true;
+
+    switch (node->type) {
+        case AST_PAIR:
+            return is_pure_expression(node->data.pair.car, info, locals) &&
+                   is_pure_expression(node->data.pair.cdr, info, locals);
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                if (!is_pure_expression(node->data.list.elements[i], info, locals)) return false;
+            }
+            return true;
+        case AST_FUNCTION_CALL:
+            if (!is_pure_callee(node->data.call.func, info, locals)) return false;
+            for (int i = 0; i < node->data.call.argc; i++) {
+                if (!is_pure_expression(node->data.call.args[i], info, locals)) return false;
+            }
+            return true;
+        case AST_IF:
+            return is_pure_expression(node->data.if_node.condition, info, locals) &&
+                   is_pure_expression(node->data.if_node.then_branch, info, locals) &&
+                   is_pure_expression(node->data.if_node.else_branch, info, locals);
+        case AST_MATCH:
+            if (!is_pure_expression(node->data.match.value, info, locals)) return false;
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                if (!is_pure_expression(node->data.match.patterns[i], info, locals) ||
+                    !is_pure_expression(node->data.match.bodies[i], info, locals)) return false;
+            }
+            return is_pure_expression(node->data.match.default_case, info, locals);
+        case AST_CSE:
+            return is_pure_expression(node->data.cse.expr, info, locals);
+        default:
+            return true;
+    }
+}
+
+static void collect_locals(ASTNode* def, NameList* locals) {
+    for (int i = 0; i < def->data.func_def.param_count; i++) {
+        name_list_add(locals, def->data.func_def.params[i]);
+    }
+    collect_bound_names(def->data.func_def.body, locals);
+}
+
+static void infer_purity(ProgramInfo* info) {
+    for (int i = 0; i < info->count; i++) {
+        info->funcs[i].def->data.func_def.pure = info->funcs[i].def_count == 1;
+    }
+
+    //再帰があるので収束するまで不純を伝播させる
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < info->count; i++) {
+            ASTNode* def = info->funcs[i].def;
+            if (!def->data.func_def.pure) continue;
+
+            NameList locals = {0};
+            collect_locals(def, &locals);
+            if (!is_pure_expression(def->data.func_def.body, info, &locals)) {
+                def->data.func_def.pure = false;
+                changed = true;
+            }
+            free(locals.names);
+        }
+    }
+}
+
+static bool ast_equal(ASTNode* a, ASTNode* b) {
+    if (a == b) return true;
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case AST_VALUE:
+            return values_equal(a->data.value, b->data.value);
+        case AST_IDENTIFIER:
+            return strcmp(a->data.identifier, b->data.identifier) == 0;
+        case AST_PAIR:
+            return ast_equal(a->data.pair.car, b->data.pair.car) &&
+                   ast_equal(a->data.pair.cdr, b->data.pair.cdr);
+        case AST_LIST:
+            if (a->data.list.count != b->data.list.count) return false;
+            for (int i = 0; i < a->data.list.count; i++) {
+                if (!ast_equal(a->data.list.elements[i], b->data.list.elements[i])) return false;
+            }
+            return true;
+        case AST_FUNCTION_CALL:
+            if (a->data.call.argc != b->data.call.argc ||
+                !ast_equal(a->data.call.func, b->data.call.func)) return false;
+            for (int i = 0; i < a->data.call.argc; i++) {
+                if (!ast_equal(a->data.call.args[i], b->data.call.args[i])) return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+//同じ値になることが保証できる式だけ共有する
+static bool is_shareable(ASTNode* node, ProgramInfo* info, NameList* locals, NameList* rebound) {
+    switch (node->type) {
+        case AST_VALUE:
+        case AST_CSE:
+            return true;
+        case AST_IDENTIFIER:
+            return !name_list_contains(rebound, node->data.identifier);
+        case AST_PAIR:
+            return is_shareable(node->data.pair.car, info, locals, rebound) &&
+                   is_shareable(node->data.pair.cdr, info, locals, rebound);
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                if (!is_shareable(node->data.list.elements[i], info, locals, rebound)) return false;
+            }
+            return true;
+        case AST_FUNCTION_CALL:
+            if (!is_pure_callee(node->data.call.func, info, locals)) return false;
+            for (int i = 0; i < node->data.call.argc; i++) {
+                if (!is_shareable(node->data.call.args[i], info, locals, rebound)) return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void site_list_add(SiteList* list, ASTNode** site) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->sites = realloc(list->sites, sizeof(ASTNode**) * list->capacity);
+    }
+    list->sites[list->count++] = site;
+}
+
+static void collect_cse_sites(ASTNode** site, ProgramInfo* info, NameList* locals, NameList* rebound,
+                       SiteList* out, int visit) {
+    ASTNode* node = *site;
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_PAIR:
+            collect_cse_sites(&node->data.pair.car, info, locals, rebound, out, visit);
+            collect_cse_sites(&node->data.pair.cdr, info, locals, rebound, out, visit);
+            break;
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                collect_cse_sites(&node->data.list.elements[i], info, locals, rebound, out, visit);
+            }
+            break;
+        case AST_FUNCTION_CALL:
+            if (is_shareable(node, info, locals, rebound)) {
+                site_list_add(out, site);
+            }
+            for (int i = 0; i < node->data.call.argc; i++) {
+                collect_cse_sites(&node->data.call.args[i], info, locals, rebound, out, visit);
+            }
+            break;
+        case AST_IF:
+            collect_cse_sites(&node->data.if_node.condition, info, locals, rebound, out, visit);
+            collect_cse_sites(&node->data.if_node.then_branch, info, locals, rebound, out, visit);
+            collect_cse_sites(&node->data.if_node.else_branch, info, locals, rebound, out, visit);
+            break;
+        case AST_MATCH:
+            collect_cse_sites(&node->data.match.value, info, locals, rebound, out, visit);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                collect_cse_sites(&node->data.match.bodies[i], info, locals, rebound, out, visit);
+            }
+            collect_cse_sites(&node->data.match.default_case, info, locals, rebound, out, visit);
+            break;
+        case AST_CSE:
+            //共有ノードは複数箇所から指されるので一度だけ辿る
+            if (node->data.cse.visit != visit) {
+                node->data.cse.visit = visit;
+                collect_cse_sites(&node->data.cse.expr, info, locals, rebound, out, visit);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static bool mentions_name(ASTNode* node, const char* name) {
+    if (!node) return false;
+
+    switch (node->type) {
+        case AST_IDENTIFIER:
+            return strcmp(node->data.identifier, name) == 0;
+        case AST_PAIR:
+            return mentions_name(node->data.pair.car, name) || mentions_name(node->data.pair.cdr, name);
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                if (mentions_name(node->data.list.elements[i], name)) return true;
+            }
+            return false;
+        case AST_FUNCTION_CALL:
+            if (mentions_name(node->data.call.func, name)) return true;
+            for (int i = 0; i < node->data.call.argc; i++) {
+                if (mentions_name(node->data.call.args[i], name)) return true;
+            }
+            return false;
+        case AST_IF:
+            return mentions_name(node->data.if_node.condition, name) ||
+                   mentions_name(node->data.if_node.then_branch, name) ||
+                   mentions_name(node->data.if_node.else_branch, name);
+        case AST_MATCH:
+            if (mentions_name(node->data.match.value, name)) return true;
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                if (mentions_name(node->data.match.patterns[i], name) ||
+                    mentions_name(node->data.match.bodies[i], name)) return true;
+            }
+            return mentions_name(node->data.match.default_case, name);
+        case AST_CSE:
+            return mentions_name(node->data.cse.expr, name);
+        default:
+            return false;
+    }
+}
+
+//関数の末尾位置にあるmatchで、枝の中で使われない局所変数のペアは作り直しに使える
+static void mark_reuse(ASTNode* node, NameList* locals) {
+    if (!node) return;
+
+    if (node->type == AST_IF) {
+        mark_reuse(node->data.if_node.then_branch, locals);
+        mark_reuse(node->data.if_node.else_branch, locals);
+    } else if (node->type == AST_FUNCTION_CALL) {
+        //展開した本体も末尾位置にある
+        mark_reuse(node->data.call.inlined, locals);
+    } else if (node->type == AST_MATCH) {
+        ASTNode* value = node->data.match.value;
+        int case_count = node->data.match.case_count;
+        if (value->type == AST_IDENTIFIER && name_list_contains(locals, value->data.identifier)) {
+            node->data.match.reuse = arena_alloc(sizeof(bool) * (case_count > 0 ? case_count : 1));
+            for (int i = 0; i < case_count; i++) {
+                node->data.match.reuse[i] = node->data.match.patterns[i]->type == AST_PAIR &&
+                    !mentions_name(node->data.match.patterns[i], value->data.identifier) &&
+                    !mentions_name(node->data.match.bodies[i], value->data.identifier);
+            }
+        }
+        for (int i = 0; i < case_count; i++) {
+            mark_reuse(node->data.match.bodies[i], locals);
+        }
+        mark_reuse(node->data.match.default_case, locals);
+    }
+}
+
+static bool is_borrowing_builtin(const char* name) {
+    return strcmp(name, "print") == 0 || strcmp(name, "eq") == 0 ||
+           strcmp(name, "car") == 0 || strcmp(name, "cdr") == 0;
+}
+
+//引数を持ち続けない組み込み関数の引数と、全体を束縛しないmatchの対象になるペアは
+//その式が終わると捨てられるので、評価器はregionに置ける
+//呼び出し先が本当にその組み込み関数かは評価時にも確かめる
+static void mark_stack_pairs(ASTNode* node, ProgramInfo* info, NameList* locals) {
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_PAIR:
+            mark_stack_pairs(node->data.pair.car, info, locals);
+            mark_stack_pairs(node->data.pair.cdr, info, locals);
+            break;
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                mark_stack_pairs(node->data.list.elements[i], info, locals);
+            }
+            break;
+        case AST_FUNCTION_CALL: {
+            ASTNode* callee = node->data.call.func;
+            bool borrowing = callee->type == AST_IDENTIFIER &&
+                is_borrowing_builtin(callee->data.identifier) &&
+                !name_list_contains(locals, callee->data.identifier) &&
+                !find_function(info, callee->data.identifier);
+            mark_stack_pairs(callee, info, locals);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                ASTNode* arg = node->data.call.args[i];
+                if (borrowing && arg->type == AST_PAIR) arg->data.pair.stack = true;
+                mark_stack_pairs(arg, info, locals);
+            }
+            mark_stack_pairs(node->data.call.inlined, info, locals);
+            break;
+        }
+        case AST_IF:
+            mark_stack_pairs(node->data.if_node.condition, info, locals);
+            mark_stack_pairs(node->data.if_node.then_branch, info, locals);
+            mark_stack_pairs(node->data.if_node.else_branch, info, locals);
+            break;
+        case AST_MATCH: {
+            ASTNode* value = node->data.match.value;
+            bool binds_whole = false;
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                ASTNode* pattern = node->data.match.patterns[i];
+                if (pattern->type == AST_IDENTIFIER && strcmp(pattern->data.identifier, "_") != 0) {
+                    binds_whole = true;
+                }
+                mark_stack_pairs(node->data.match.bodies[i], info, locals);
+            }
+            if (value->type == AST_PAIR && !binds_whole) value->data.pair.stack = true;
+            mark_stack_pairs(value, info, locals);
+            mark_stack_pairs(node->data.match.default_case, info, locals);
+            break;
+        }
+        case AST_FUNCTION_DEF: {
+            NameList inner = {0};
+            collect_locals(node, &inner);
+            mark_stack_pairs(node->data.func_def.body, info, &inner);
+            free(inner.names);
+            break;
+        }
+        case AST_CSE:
+            mark_stack_pairs(node->data.cse.expr, info, locals);
+            break;
+        default:
+            break;
+    }
+}
+
+//展開
+
+#define INLINE_DEPTH 3
+
+//展開する本体の中での名前の置き換え。後から入れたものが内側のスコープ
+typedef struct {
+    char** names;
+    ASTNode** nodes;
+    int count;
+    int capacity;
+} InlineScope;
+
+static void scope_push(InlineScope* scope, char* name, ASTNode* node) {
+    if (scope->count == scope->capacity) {
+        scope->capacity = scope->capacity ? scope->capacity * 2 : 8;
+        scope->names = realloc(scope->names, sizeof(char*) * scope->capacity);
+        scope->nodes = realloc(scope->nodes, sizeof(ASTNode*) * scope->capacity);
+    }
+    scope->names[scope->count] = name;
+    scope->nodes[scope->count] = node;
+    scope->count++;
+}
+
+static ASTNode* scope_find(InlineScope* scope, const char* name) {
+    for (int i = scope->count - 1; i >= 0; i--) {
+        if (strcmp(scope->names[i], name) == 0) return scope->nodes[i];
+    }
+    return NULL;
+}
+
+static int ast_size(ASTNode* node) {
+    if (!node) return 0;
+
+    switch (node->type) {
+        case AST_PAIR:
+            return 1 + ast_size(node->data.pair.car) + ast_size(node->data.pair.cdr);
+        case AST_LIST: {
+            int size = 1;
+            for (int i = 0; i < node->data.list.count; i++) {
+                size += ast_size(node->data.list.elements[i]);
+            }
+            return size;
+        }
+        case AST_FUNCTION_CALL: {
+            int size = 1 + ast_size(node->data.call.func);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                size += ast_size(node->data.call.args[i]);
+            }
+            return size;
+        }
+        case AST_IF:
+            return 1 + ast_size(node->data.if_node.condition) +
+                   ast_size(node->data.if_node.then_branch) + ast_size(node->data.if_node.else_branch);
+        case AST_MATCH: {
+            int size = 1 + ast_size(node->data.match.value) + ast_size(node->data.match.default_case);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                size += ast_size(node->data.match.patterns[i]) + ast_size(node->data.match.bodies[i]);
+            }
+            return size;
+        }
+        case AST_CSE:
+            return ast_size(node->data.cse.expr);
+        case AST_FUNCTION_DEF:
+            //入れ子の定義は呼び出し元の環境に束縛されるので展開しない
+            return INT_MAX / 2;
+        default:
+            return 1;
+    }
+}
+
+static int count_mentions(ASTNode* node, const char* name) {
+    if (!node) return 0;
+
+    switch (node->type) {
+        case AST_IDENTIFIER:
+            return strcmp(node->data.identifier, name) == 0;
+        case AST_PAIR:
+            return count_mentions(node->data.pair.car, name) + count_mentions(node->data.pair.cdr, name);
+        case AST_LIST: {
+            int count = 0;
+            for (int i = 0; i < node->data.list.count; i++) {
+                count += count_mentions(node->data.list.elements[i], name);
+            }
+            return count;
+        }
+        case AST_FUNCTION_CALL: {
+            int count = count_mentions(node->data.call.func, name);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                count += count_mentions(node->data.call.args[i], name);
+            }
+            return count;
+        }
+        case AST_IF:
+            return count_mentions(node->data.if_node.condition, name) +
+                   count_mentions(node->data.if_node.then_branch, name) +
+                   count_mentions(node->data.if_node.else_branch, name);
+        case AST_MATCH: {
+            int count = count_mentions(node->data.match.value, name) +
+                        count_mentions(node->data.match.default_case, name);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                count += count_mentions(node->data.match.patterns[i], name) +
+                         count_mentions(node->data.match.bodies[i], name);
+            }
+            return count;
+        }
+        case AST_CSE:
+            //共有された式は何度評価されるか分からない
+            return 2 * count_mentions(node->data.cse.expr, name);
+        default:
+            return 0;
+    }
+}
+
+//本体を評価順に辿り、必ず最初に評価される仮引数の番号をorderに積む
+//分岐か呼び出しの終わりに着いたら、その先は順番も回数も分からないのでfalseで止める
+static bool strict_order(ASTNode* node, ASTNode* def, int* order, int* count) {
+    if (!node) return true;
+
+    switch (node->type) {
+        case AST_VALUE:
+            return true;
+        case AST_IDENTIFIER:
+            for (int i = 0; i < def->data.func_def.param_count; i++) {
+                if (strcmp(def->data.func_def.params[i], node->data.identifier) == 0) {
+                    order[(*count)++] = i;
+                    break;
+                }
+            }
+            return true;
+        case AST_PAIR:
+            return strict_order(node->data.pair.car, def, order, count) &&
+                   strict_order(node->data.pair.cdr, def, order, count);
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                if (!strict_order(node->data.list.elements[i], def, order, count)) return false;
+            }
+            return true;
+        case AST_FUNCTION_CALL:
+            if (!strict_order(node->data.call.func, def, order, count)) return false;
+            for (int i = 0; i < node->data.call.argc; i++) {
+                if (!strict_order(node->data.call.args[i], def, order, count)) return false;
+            }
+            return false;
+        case AST_IF:
+            strict_order(node->data.if_node.condition, def, order, count);
+            return false;
+        case AST_MATCH:
+            strict_order(node->data.match.value, def, order, count);
+            return false;
+        default:
+            return false;
+    }
+}
+
+//本体の自由な名前が呼び出し元の局所変数に捕まらないか
+static bool captures_local(ASTNode* node, NameList* callee_locals, NameList* caller_locals) {
+    if (!node) return false;
+
+    switch (node->type) {
+        case AST_IDENTIFIER:
+            return !name_list_contains(callee_locals, node->data.identifier) &&
+                   name_list_contains(caller_locals, node->data.identifier);
+        case AST_PAIR:
+            return captures_local(node->data.pair.car, callee_locals, caller_locals) ||
+                   captures_local(node->data.pair.cdr, callee_locals, caller_locals);
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                if (captures_local(node->data.list.elements[i], callee_locals, caller_locals)) return true;
+            }
+            return false;
+        case AST_FUNCTION_CALL:
+            if (captures_local(node->data.call.func, callee_locals, caller_locals)) return true;
+            for (int i = 0; i < node->data.call.argc; i++) {
+                if (captures_local(node->data.call.args[i], callee_locals, caller_locals)) return true;
+            }
+            return false;
+        case AST_IF:
+            return captures_local(node->data.if_node.condition, callee_locals, caller_locals) ||
+                   captures_local(node->data.if_node.then_branch, callee_locals, caller_locals) ||
+                   captures_local(node->data.if_node.else_branch, callee_locals, caller_locals);
+        case AST_MATCH:
+            if (captures_local(node->data.match.value, callee_locals, caller_locals)) return true;
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                //パターンの名前は付け替えるので、それ以外の式だけ見る
+                ASTNode* pattern = node->data.match.patterns[i];
+                if (pattern->type != AST_IDENTIFIER && pattern->type != AST_PAIR &&
+                    captures_local(pattern, callee_locals, caller_locals)) return true;
+                if (captures_local(node->data.match.bodies[i], callee_locals, caller_locals)) return true;
+            }
+            return captures_local(node->data.match.default_case, callee_locals, caller_locals);
+        case AST_CSE:
+            return captures_local(node->data.cse.expr, callee_locals, caller_locals);
+        default:
+            return false;
+    }
+}
+
+static bool is_trivial_argument(ASTNode* arg, NameList* locals) {
+    return arg->type == AST_VALUE ||
+           (arg->type == AST_IDENTIFIER && name_list_contains(locals, arg->data.identifier));
+}
+
+//呼び出しを本体で置き換えても、引数を評価する回数と順番が変わらないか
+static bool can_inline_arguments(ASTNode* call, ASTNode* def, NameList* locals) {
+    int argc = call->data.call.argc;
+    bool all_trivial = true;
+    for (int i = 0; i < argc; i++) {
+        if (!is_trivial_argument(call->data.call.args[i], locals)) all_trivial = false;
+    }
+    if (all_trivial) return true;
+
+    //値や局所変数でない引数は、本体で一度だけ、他の呼び出しより先に、引数の順に使われるものに限る
+    int* order = malloc(sizeof(int) * (ast_size(def->data.func_def.body) + 1));
+    int count = 0;
+    strict_order(def->data.func_def.body, def, order, &count);
+
+    bool ok = true;
+    int last = -1;
+    for (int i = 0; i < argc && ok; i++) {
+        if (is_trivial_argument(call->data.call.args[i], locals)) continue;
+        int position = -1;
+        for (int j = 0; j < count; j++) {
+            if (order[j] == i) position = j;
+        }
+        ok = position > last && count_mentions(def->data.func_def.body, def->data.func_def.params[i]) == 1;
+        last = position;
+    }
+    free(order);
+    return ok;
+}
+
+static FunctionInfo* inline_candidate(ASTNode* call, ProgramInfo* info, NameList* locals) {
+    ASTNode* callee = call->data.call.func;
+    if (callee->type != AST_IDENTIFIER || name_list_contains(locals, callee->data.identifier)) return NULL;
+
+    FunctionInfo* func = find_function(info, callee->data.identifier);
+    if (!func || func->def_count != 1) return NULL;
+
+    ASTNode* def = func->def;
+    if (def->data.func_def.param_count != call->data.call.argc) return NULL;
+    if (ast_size(def->data.func_def.body) > current->options.inline_size) return NULL;
+    if (mentions_name(def->data.func_def.body, def->data.func_def.name)) return NULL;
+
+    NameList callee_locals = {0};
+    collect_locals(def, &callee_locals);
+    bool ok = !captures_local(def->data.func_def.body, &callee_locals, locals) &&
+              can_inline_arguments(call, def, locals);
+    free(callee_locals.names);
+    return ok ? func : NULL;
+}
+
+//ASTNodeを複製する。--heap-profileの集計は複製ごとに持つ
+static ASTNode* ast_clone(ASTNode* node) {
+    ASTNode* copy = ast_new(node->type, NULL);
+    HeapSite* site = copy->heap_site;
+    *copy = *node;
+    copy->heap_site = site;
+    if (site) site->node = copy;
+    return copy;
+}
+
+static ASTNode** inline_copy_all(ASTNode** nodes, int count, InlineScope* scope, NameList* locals);
+
+static ASTNode* inline_copy(ASTNode* node, InlineScope* scope, NameList* locals);
+
+//パターンで束縛する名前は、呼び出し元の名前とぶつからないよう作り直す
+//#は識別子に使えないので、ソースの名前とは重ならない
+static ASTNode* inline_pattern(ASTNode* pattern, InlineScope* scope, NameList* locals) {
+    if (pattern->type == AST_IDENTIFIER) {
+        ASTNode* copy = ast_clone(pattern);
+        if (strcmp(pattern->data.identifier, "_") == 0) return copy;
+        char name[256];
+        snprintf(name, sizeof(name), "%s#%d", pattern->data.identifier, ++current->inline_count);
+        copy->data.identifier = arena_strdup(name);
+        scope_push(scope, pattern->data.identifier, copy);
+        name_list_add(locals, copy->data.identifier);
+        return copy;
+    } else if (pattern->type == AST_PAIR) {
+        ASTNode* copy = ast_clone(pattern);
+        copy->data.pair.car = inline_pattern(pattern->data.pair.car, scope, locals);
+        copy->data.pair.cdr = inline_pattern(pattern->data.pair.cdr, scope, locals);
+        copy->data.pair.stack = false;
+        return copy;
+    }
+    return inline_copy(pattern, scope, locals);
+}
+
+//仮引数は引数の式に、束縛する名前は新しい名前に置き換えて本体を複製する
+static ASTNode* inline_copy(ASTNode* node, InlineScope* scope, NameList* locals) {
+    if (!node) return NULL;
+    if (node->type == AST_CSE) return inline_copy(node->data.cse.expr, scope, locals);
+
+    if (node->type == AST_IDENTIFIER) {
+        ASTNode* bound = scope_find(scope, node->data.identifier);
+        if (!bound) return ast_clone(node);
+        //値と名前は何度使ってもよいので複製する。それ以外の引数は一度しか使われない
+        return bound->type == AST_VALUE || bound->type == AST_IDENTIFIER ? ast_clone(bound) : bound;
+    }
+
+    ASTNode* copy = ast_clone(node);
+    switch (node->type) {
+        case AST_PAIR:
+            copy->data.pair.car = inline_copy(node->data.pair.car, scope, locals);
+            copy->data.pair.cdr = inline_copy(node->data.pair.cdr, scope, locals);
+            copy->data.pair.stack = false;
+            break;
+        case AST_LIST:
+            copy->data.list.elements = inline_copy_all(node->data.list.elements, node->data.list.count, scope, locals);
+            break;
+        case AST_FUNCTION_CALL:
+            copy->data.call.func = inline_copy(node->data.call.func, scope, locals);
+            copy->data.call.args = inline_copy_all(node->data.call.args, node->data.call.argc, scope, locals);
+            copy->data.call.inlined = NULL;
+            copy->data.call.inlined_from = NULL;
+            break;
+        case AST_IF:
+            copy->data.if_node.condition = inline_copy(node->data.if_node.condition, scope, locals);
+            copy->data.if_node.then_branch = inline_copy(node->data.if_node.then_branch, scope, locals);
+            copy->data.if_node.else_branch = inline_copy(node->data.if_node.else_branch, scope, locals);
+            break;
+        case AST_MATCH: {
+            int case_count = node->data.match.case_count;
+            copy->data.match.value = inline_copy(node->data.match.value, scope, locals);
+            copy->data.match.patterns = arena_alloc(sizeof(ASTNode*) * (case_count > 0 ? case_count : 1));
+            copy->data.match.bodies = arena_alloc(sizeof(ASTNode*) * (case_count > 0 ? case_count : 1));
+            for (int i = 0; i < case_count; i++) {
+                int mark = scope->count;
+                copy->data.match.patterns[i] = inline_pattern(node->data.match.patterns[i], scope, locals);
+                copy->data.match.bodies[i] = inline_copy(node->data.match.bodies[i], scope, locals);
+                scope->count = mark;
+            }
+            copy->data.match.default_case = inline_copy(node->data.match.default_case, scope, locals);
+            //末尾かどうかは展開先で決め直す
+            copy->data.match.reuse = NULL;
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+static ASTNode** inline_copy_all(ASTNode** nodes, int count, InlineScope* scope, NameList* locals) {
+    ASTNode** copies = arena_alloc(sizeof(ASTNode*) * (count > 0 ? count : 1));
+    for (int i = 0; i < count; i++) {
+        copies[i] = inline_copy(nodes[i], scope, locals);
+    }
+    return copies;
+}
+
+//小さくて自分を呼ばない関数の呼び出しに、引数を埋め込んだ本体を持たせる
+//展開した本体の中の呼び出しもINLINE_DEPTH段まで展開する
+static void inline_calls(ASTNode* node, ProgramInfo* info, NameList* locals, int depth) {
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_PAIR:
+            inline_calls(node->data.pair.car, info, locals, depth);
+            inline_calls(node->data.pair.cdr, info, locals, depth);
+            break;
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                inline_calls(node->data.list.elements[i], info, locals, depth);
+            }
+            break;
+        case AST_FUNCTION_CALL: {
+            //引数の式は本体の中でも共有するので、一度展開したら辿らない
+            if (node->data.call.inlined) break;
+            inline_calls(node->data.call.func, info, locals, depth);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                inline_calls(node->data.call.args[i], info, locals, depth);
+            }
+            FunctionInfo* func = inline_candidate(node, info, locals);
+            if (!func) break;
+
+            ASTNode* def = func->def;
+            InlineScope scope = {0};
+            for (int i = 0; i < def->data.func_def.param_count; i++) {
+                scope_push(&scope, def->data.func_def.params[i], node->data.call.args[i]);
+            }
+            node->data.call.inlined = inline_copy(def->data.func_def.body, &scope, locals);
+            node->data.call.inlined_from = def->data.func_def.body;
+            free(scope.names);
+            free(scope.nodes);
+            if (depth < INLINE_DEPTH) {
+                inline_calls(node->data.call.inlined, info, locals, depth + 1);
+            }
+            break;
+        }
+        case AST_IF:
+            inline_calls(node->data.if_node.condition, info, locals, depth);
+            inline_calls(node->data.if_node.then_branch, info, locals, depth);
+            inline_calls(node->data.if_node.else_branch, info, locals, depth);
+            break;
+        case AST_MATCH:
+            inline_calls(node->data.match.value, info, locals, depth);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                inline_calls(node->data.match.bodies[i], info, locals, depth);
+            }
+            inline_calls(node->data.match.default_case, info, locals, depth);
+            break;
+        case AST_FUNCTION_DEF: {
+            NameList inner = {0};
+            collect_locals(node, &inner);
+            inline_calls(node->data.func_def.body, info, &inner, depth);
+            free(inner.names);
+            break;
+        }
+        case AST_CSE:
+            inline_calls(node->data.cse.expr, info, locals, depth);
+            break;
+        default:
+            break;
+    }
+}
+
+static void eliminate_common_calls(ASTNode* def, ProgramInfo* info) {
+    NameList locals = {0};
+    NameList rebound = {0};
+    collect_locals(def, &locals);
+    collect_bound_names(def->data.func_def.body, &rebound);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        SiteList list = {0};
+        collect_cse_sites(&def->data.func_def.body, info, &locals, &rebound, &list, ++current->cse_visit);
+
+        //先行順なので外側の式から共有される
+        for (int i = 0; i < list.count && !changed; i++) {
+            ASTNode* expr = *list.sites[i];
+            ASTNode* shared = NULL;
+            for (int j = i + 1; j < list.count; j++) {
+                if (!ast_equal(expr, *list.sites[j])) continue;
+                if (!shared) {
+                    shared = ast_new(AST_CSE, NULL);
+                    shared->line = expr->line;
+                    shared->column = expr->column;
+                    shared->data.cse.expr = expr;
+                    shared->data.cse.slot = def->data.func_def.cse_slots++;
+                    shared->data.cse.visit = 0;
+                    *list.sites[i] = shared;
+                }
+                *list.sites[j] = shared;
+            }
+            changed = shared != NULL;
+        }
+        free(list.sites);
+    }
+
+    free(locals.names);
+    free(rebound.names);
+}
+
+//関数表はns_parseをまたいで積み上げる
+static void optimize_program(ASTNode** statements, int count) {
+    ProgramInfo* info = &current->functions;
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type != AST_FUNCTION_DEF) continue;
+        FunctionInfo* func = find_function(info, statements[i]->data.func_def.name);
+        if (func) {
+            func->def_count++;
+            //前のパースで定義済みなら、そちらの評価結果はもう純粋とは言えない
+            if (func->parse != current->parse_count) current->purity_stale = true;
+            continue;
+        }
+        if (info->count == info->capacity) {
+            info->capacity = info->capacity ? info->capacity * 2 : 16;
+            info->funcs = realloc(info->funcs, sizeof(FunctionInfo) * info->capacity);
+        }
+        info->funcs[info->count].name = statements[i]->data.func_def.name;
+        info->funcs[info->count].def = statements[i];
+        info->funcs[info->count].def_count = 1;
+        info->funcs[info->count].parse = current->parse_count;
+        info->count++;
+    }
+
+    infer_purity(info);
+
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type != AST_FUNCTION_DEF) continue;
+        if (current->options.cse) {
+            eliminate_common_calls(statements[i], info);
+        }
+    }
+
+    //共有した式は呼び出し元の枠を使うので、そのまま引数として埋め込める
+    //呼び出し先の本体の共有は展開する時に外す
+    if (current->options.inline_size > 0) {
+        for (int i = 0; i < count; i++) {
+            NameList locals = {0};
+            collect_bound_names(statements[i], &locals);
+            inline_calls(statements[i], info, &locals, 0);
+            free(locals.names);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type != AST_FUNCTION_DEF) continue;
+        NameList locals = {0};
+        collect_locals(statements[i], &locals);
+        mark_reuse(statements[i]->data.func_def.body, &locals);
+        free(locals.names);
+    }
+
+    for (int i = 0; i < count; i++) {
+        NameList locals = {0};
+        collect_bound_names(statements[i], &locals);
+        mark_stack_pairs(statements[i], info, &locals);
+        free(locals.names);
+    }
+}
+
+static double elapsed_ms(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+    *start = now;
+    return ms;
+}
+
+static const char* ast_type_names[] = {
+    "value", "identifier", "pair", "list",
+    "function_call", "function_def", "if", "match", "cse"
+};
+
+static void units_free(WatchUnit* units, int count);
+
+//公開API
+
+void ns_default_options(NsOptions* options) {
+    memset(options, 0, sizeof(*options));
+    options->cse = true;
+    options->memo_size = 4096;
+    options->inline_size = 12;
+    options->output = stdout;
+}
+
+NsInterp* ns_new(const NsOptions* options) {
+    NsInterp* ns = calloc(1, sizeof(NsInterp));
+    if (options) {
+        ns->options = *options;
+    } else {
+        ns_default_options(&ns->options);
+    }
+    if (!ns->options.output) ns->options.output = stdout;
+    if (ns->options.memo_size <= 0) ns->options.memo_size = 4096;
+
+    ns->root = ns;
+    pthread_mutex_init(&ns->task_lock, NULL);
+    if (ns->options.heap_profile) {
+        ns->profile.interval = 64 * 1024;
+        ns->profile.next_sample = 0;
+        ns->profile.snapshots = calloc(HEAP_SNAPSHOT_MAX, sizeof(HeapSnapshot));
+    }
+
+    NsInterp* saved = current;
+    current = ns;
+    ns->globals = env_new(NULL);
+    setup_minimal_builtins(ns->globals);
+    current = saved;
+    return ns;
+}
+
+void ns_free(NsInterp* ns) {
+    if (!ns) return;
+    NsInterp* saved = current;
+    current = ns;
+
+    memo_clear();
+    reuse_flush();
+    env_release(ns->globals);
+    for (int i = 0; i < ns->literal_count; i++) {
+        value_release(ns->literals[i]);
+    }
+    value_release(ns->numbers);
+    for (int i = 0; i < 256; i++) {
+        value_release(ns->char_encodings[i]);
+    }
+    while (ns->arena) {
+        ArenaBlock* next = ns->arena->next;
+        free(ns->arena);
+        ns->arena = next;
+    }
+    free(ns->functions.funcs);
+    units_free(ns->units, ns->unit_count);
+    free(ns->region);
+    pthread_mutex_destroy(&ns->task_lock);
+    for (int i = 0; i < ns->profile.snapshot_count; i++) {
+        snapshot_free(&ns->profile.snapshots[i]);
+    }
+    free(ns->profile.snapshots);
+    snapshot_free(&ns->profile.peak);
+
+    current = saved == ns ? NULL : saved;
+    free(ns);
+}
+
+//状態を切り替えて、ホスト関数からの再入は拒否する
+static bool ns_enter(NsInterp* ns, NsInterp** saved) {
+    if (ns->running) return false;
+    ns->running = true;
+    *saved = current;
+    current = ns;
+    ns->status = NS_OK;
+    ns->error[0] = '\0';
+    return true;
+}
+
+static NsStatus ns_leave(NsInterp* ns, NsInterp* saved) {
+    ns->running = false;
+    current = saved;
+    return ns->status;
+}
+
+NsStatus ns_register_builtin(NsInterp* ns, const char* name, NsBuiltin func) {
+    NsInterp* saved;
+    if (!ns_enter(ns, &saved)) return NS_ERR_BUSY;
+
+    //純粋と推論した関数が呼ぶ名前を差し替えるなら、推論結果は使えない
+    if (is_pure_builtin(name) || find_function(&ns->functions, name)) {
+        ns->purity_stale = true;
+    }
+    define_builtin(ns->globals, name, func);
+    return ns_leave(ns, saved);
+}
+
+static void cleanup_tokens(NsInterp* ns) {
+    for (int i = 0; i < ns->token_count; i++) {
+        free(ns->tokens[i].value);
+    }
+    free(ns->tokens);
+    ns->tokens = NULL;
+    ns->token_count = 0;
+    if (ns->lexer) lexer_free(ns->lexer);
+    ns->lexer = NULL;
+}
+
+//構文エラーはparse_errorに飛ぶ
+static void lex_source(NsInterp* ns, const char* source) {
+    ns->lexer = lexer_new(source);
+    int token_capacity = 256;
+    ns->tokens = malloc(sizeof(Token) * token_capacity);
+
+    Token token;
+    do {
+        token = next_token(ns->lexer);
+        if (ns->token_count == token_capacity) {
+            token_capacity *= 2;
+            ns->tokens = realloc(ns->tokens, sizeof(Token) * token_capacity);
+        }
+        ns->tokens[ns->token_count++] = token;
+    } while (token.type != TOKEN_EOF);
+}
+
+NsStatus ns_parse(NsInterp* ns, const char* source, NsProgram** program) {
+    NsInterp* saved;
+    if (!ns_enter(ns, &saved)) return NS_ERR_BUSY;
+    *program = NULL;
+
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+
+    if (setjmp(ns->parse_error)) {
+        cleanup_tokens(ns);
+        ns->site_node = NULL;
+        return ns_leave(ns, saved);
+    }
+
+    lex_source(ns, source);
+    ns->stats.lex_ms += elapsed_ms(&clock);
+
+    //文の配列もアリーナに置くので構文エラーで抜けても漏れない
+    Parser parser = {ns->tokens, 0, ns->token_count};
+    NsProgram* parsed = arena_alloc(sizeof(NsProgram));
+    parsed->statements = NULL;
+    parsed->count = 0;
+    int capacity = 0;
+    while (current_token(&parser) && current_token(&parser)->type != TOKEN_EOF) {
+        ASTNode* statement = parse_statement(&parser);
+        parsed->statements = arena_append(parsed->statements, parsed->count++, &capacity, statement);
+    }
+    cleanup_tokens(ns);
+    ns->stats.parse_ms += elapsed_ms(&clock);
+
+    ns->parse_count++;
+    optimize_program(parsed->statements, parsed->count);
+    ns->stats.optimize_ms += elapsed_ms(&clock);
+
+    *program = parsed;
+    return ns_leave(ns, saved);
+}
+
+//finishedには最後まで評価できた文の数を返す
+static NsStatus eval_program(NsInterp* ns, NsProgram* program, Value** result, int* finished) {
+    if (result) *result = NULL;
+    if (finished) *finished = 0;
+    NsInterp* saved;
+    if (!ns_enter(ns, &saved)) return NS_ERR_BUSY;
+
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    ns->fuel_used = 0;
+
+    Value* last_result = NULL;
+    for (int i = 0; i < program->count; i++) {
+        if (last_result) value_release(last_result);
+        last_result = evaluate(program->statements[i], ns->globals);
+        if (!last_result) break;
+        if (finished) *finished = i + 1;
+    }
+    //未だ終わっていないfutureを待ってから、その分のカウンタを足す
+    pool_wait(tasks_done, ns);
+    stats_merge(&ns->stats, &ns->task_stats);
+    memset(&ns->task_stats, 0, sizeof(ns->task_stats));
+    reuse_flush();
+    ns->site_node = NULL;
+    if (ns->options.heap_profile) {
+        ns->profile.next_sample = 0;
+        profile_sample();
+    }
+    ns->stats.eval_ms += elapsed_ms(&clock);
+
+    if (result && ns->status == NS_OK) {
+        *result = last_result;
+    } else if (last_result) {
+        value_release(last_result);
+    }
+    return ns_leave(ns, saved);
+}
+
+NsStatus ns_eval(NsInterp* ns, NsProgram* program, Value** result) {
+    return eval_program(ns, program, result, NULL);
+}
+
+NsStatus ns_run(NsInterp* ns, const char* source) {
+    NsProgram* program;
+    NsStatus status = ns_parse(ns, source, &program);
+    if (status != NS_OK) return status;
+    return ns_eval(ns, program, NULL);
+}
+
+//差分の評価
+
+//トップレベルの文一つ分。変わっていなければASTも評価結果もそのまま使う
+struct WatchUnit {
+    //トークンの種類と値を並べたもの。空白やコメントの違いは無視される
+    char* key;
+    //関数定義ならその名前
+    char* name;
+    ASTNode* node;
+    //文の中に出てくる名前。関数の依存関係に使う
+    NameList refs;
+    int start;
+    int end;
+    bool parsed;
+    //最後まで評価できた。エラーで止まった後の文は次の更新で評価する
+    bool done;
+};
+
+typedef struct {
+    WatchUnit* units;
+    int count;
+    int capacity;
+    NameList changed;
+    //前回の文のうち引き継いだもの
+    bool* taken;
+} WatchBuild;
+
+static void units_free(WatchUnit* units, int count) {
+    for (int i = 0; i < count; i++) {
+        free(units[i].key);
+        free(units[i].refs.names);
+    }
+    free(units);
+}
+
+static char* token_key(Token* tokens, int start, int end) {
+    size_t length = 1;
+    for (int i = start; i < end; i++) {
+        length += 2 + (tokens[i].value ? strlen(tokens[i].value) : 0);
+    }
+    char* key = malloc(length);
+    char* out = key;
+    for (int i = start; i < end; i++) {
+        *out++ = 'A' + tokens[i].type;
+        if (tokens[i].value) out = stpcpy(out, tokens[i].value);
+        *out++ = '\x1f';
+    }
+    *out = '\0';
+    return key;
+}
+
+static void collect_references(ASTNode* node, NameList* out) {
+    if (!node) return;
+
+    switch (node->type) {
+        case AST_IDENTIFIER:
+            if (!name_list_contains(out, node->data.identifier)) name_list_add(out, node->data.identifier);
+            break;
+        case AST_PAIR:
+            collect_references(node->data.pair.car, out);
+            collect_references(node->data.pair.cdr, out);
+            break;
+        case AST_LIST:
+            for (int i = 0; i < node->data.list.count; i++) {
+                collect_references(node->data.list.elements[i], out);
+            }
+            break;
+        case AST_FUNCTION_CALL:
+            collect_references(node->data.call.func, out);
+            for (int i = 0; i < node->data.call.argc; i++) {
+                collect_references(node->data.call.args[i], out);
+            }
+            break;
+        case AST_FUNCTION_DEF:
+            collect_references(node->data.func_def.body, out);
+            break;
+        case AST_IF:
+            collect_references(node->data.if_node.condition, out);
+            collect_references(node->data.if_node.then_branch, out);
+            collect_references(node->data.if_node.else_branch, out);
+            break;
+        case AST_MATCH:
+            collect_references(node->data.match.value, out);
+            for (int i = 0; i < node->data.match.case_count; i++) {
+                collect_references(node->data.match.patterns[i], out);
+                collect_references(node->data.match.bodies[i], out);
+            }
+            collect_references(node->data.match.default_case, out);
+            break;
+        case AST_CSE:
+            collect_references(node->data.cse.expr, out);
+            break;
+        default:
+            break;
+    }
+}
+
+static bool refers_to_any(NameList* refs, NameList* names) {
+    for (int i = 0; i < refs->count; i++) {
+        if (name_list_contains(names, refs->names[i])) return true;
+    }
+    return false;
+}
+
+//関数定義は括弧の対応だけ見て読み飛ばす。閉じていなければ普通にパースしてエラーにする
+static int skip_function_def(Parser* parser) {
+    int depth = 0;
+    bool body = false;
+    for (int i = parser->pos; i < parser->count && parser->tokens[i].type != TOKEN_EOF; i++) {
+        if (parser->tokens[i].type == TOKEN_LBRACE) {
+            depth++;
+            body = true;
+        } else if (parser->tokens[i].type == TOKEN_RBRACE && --depth == 0 && body) {
+            return i + 1;
+        }
+    }
+    parse_statement(parser);
+    return parser->pos;
+}
+
+//括弧の組を一つ読み飛ばす。中身の正しさはパースする時に確かめる
+static int skip_group(Token* tokens, int i, int count, TokenType open) {
+    if (i >= count || tokens[i].type != open) return -1;
+    int depth = 0;
+    for (; i < count && tokens[i].type != TOKEN_EOF; i++) {
+        TokenType type = tokens[i].type;
+        if (type == TOKEN_LPAREN || type == TOKEN_LBRACE) {
+            depth++;
+        } else if ((type == TOKEN_RPAREN || type == TOKEN_RBRACE) && --depth == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+static int skip_call(Token* tokens, int i, int count) {
+    if (i >= count) return -1;
+    switch (tokens[i].type) {
+        case TOKEN_NONE: case TOKEN_NIL: case TOKEN_UNDEFINED: case TOKEN_NULL:
+        case TOKEN_IDENTIFIER: case TOKEN_NUMBER: case TOKEN_STRING:
+            i++;
+            break;
+        case TOKEN_PAIR: case TOKEN_LIST:
+            i = skip_group(tokens, i + 1, count, TOKEN_LPAREN);
+            break;
+        case TOKEN_LPAREN:
+            i = skip_group(tokens, i, count, TOKEN_LPAREN);
+            break;
+        default:
+            return -1;
+    }
+    while (i >= 0 && i < count && tokens[i].type == TOKEN_LPAREN) {
+        i = skip_group(tokens, i, count, TOKEN_LPAREN);
+    }
+    return i;
+}
+
+//式の文の終わりをASTを作らずに探す。parse_expressionと同じ形だけ見る
+static int skip_expression(Token* tokens, int i, int count) {
+    if (i < count && tokens[i].type == TOKEN_IF) {
+        bool match = i + 1 < count && tokens[i + 1].type == TOKEN_MATCH;
+        i = skip_call(tokens, i + 1 + match, count);
+        if (match) i = skip_group(tokens, i, count, TOKEN_LBRACE);
+        i = skip_group(tokens, i, count, TOKEN_LBRACE);
+        if (i >= 0 && i < count && tokens[i].type == TOKEN_ELSE) {
+            i = skip_group(tokens, i + 1, count, TOKEN_LBRACE);
+        }
+        return i;
+    }
+    if (i < count && tokens[i].type == TOKEN_MATCH) {
+        i = skip_call(tokens, i + 1, count);
+        return skip_group(tokens, i, count, TOKEN_LBRACE);
+    }
+    return skip_call(tokens, i, count);
+}
+
+static void unit_parse(WatchUnit* unit, Parser* parser) {
+    parser->pos = unit->start;
+    unit->node = parse_statement(parser);
+    if (parser->pos != unit->end) {
+        parse_fail("unexpected token %d", parser->tokens[parser->pos].type);
+    }
+    unit->refs.count = 0;
+    collect_references(unit->node, &unit->refs);
+    unit->parsed = true;
+}
+
+static void forget_function(ProgramInfo* info, const char* name) {
+    for (int i = 0; i < info->count; i++) {
+        if (strcmp(info->funcs[i].name, name) == 0) {
+            memmove(&info->funcs[i], &info->funcs[i + 1], sizeof(FunctionInfo) * (info->count - i - 1));
+            info->count--;
+            return;
+        }
+    }
+}
+
+static void add_changed_name(NameList* changed, char* name) {
+    if (name && !name_list_contains(changed, name)) name_list_add(changed, name);
+}
+
+//前回のns_updateと文ごとに比べ、変わった文と、変わった関数に依存する文だけ評価する
+//依存する関数定義も作り直すので、展開や純粋性の推論は古い定義を引きずらない
+static NsStatus update_units(NsInterp* ns, const char* source, NsProgram** program) {
+    //longjmpで戻ってきた時にも残るようヒープに置く
+    WatchBuild* build = calloc(1, sizeof(WatchBuild));
+
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+
+    if (setjmp(ns->parse_error)) {
+        cleanup_tokens(ns);
+        ns->site_node = NULL;
+        units_free(build->units, build->count);
+        free(build->changed.names);
+        free(build->taken);
+        free(build);
+        return ns->status;
+    }
+
+    lex_source(ns, source);
+    ns->stats.lex_ms += elapsed_ms(&clock);
+
+    //文の境目を探す。ASTは変わった文の分だけ後で作る
+    Parser parser = {ns->tokens, 0, ns->token_count};
+    while (current_token(&parser) && current_token(&parser)->type != TOKEN_EOF) {
+        if (build->count == build->capacity) {
+            build->capacity = build->capacity ? build->capacity * 2 : 64;
+            build->units = realloc(build->units, sizeof(WatchUnit) * build->capacity);
+        }
+        WatchUnit* unit = &build->units[build->count++];
+        memset(unit, 0, sizeof(*unit));
+        unit->start = parser.pos;
+
+        int end;
+        if (current_token(&parser)->type == TOKEN_FUNCTION) {
+            end = skip_function_def(&parser);
+            Token* name = &ns->tokens[unit->start + 1];
+            if (name->type == TOKEN_IDENTIFIER) unit->name = arena_strdup(name->value);
+        } else {
+            end = skip_expression(ns->tokens, unit->start, ns->token_count);
+            //読み飛ばせない文は普通にパースしてエラーにする
+            if (end < 0) {
+                parse_statement(&parser);
+                end = parser.pos;
+            }
+        }
+        unit->key = token_key(ns->tokens, unit->start, end);
+        unit->end = end;
+        parser.pos = end;
+    }
+
+    WatchUnit* units = build->units;
+    int count = build->count;
+    NameList* changed = &build->changed;
+
+    //同じ位置か、前回のどこかに同じ文があれば引き継ぐ
+    bool* taken = build->taken = calloc(ns->unit_count + 1, sizeof(bool));
+    for (int i = 0; i < count; i++) {
+        WatchUnit* unit = &units[i];
+        int found = -1;
+        if (i < ns->unit_count && !taken[i] && strcmp(ns->units[i].key, unit->key) == 0) {
+            found = i;
+        }
+        for (int j = 0; j < ns->unit_count && found < 0; j++) {
+            if (!taken[j] && strcmp(ns->units[j].key, unit->key) == 0) found = j;
+        }
+        if (found < 0) {
+            add_changed_name(changed, unit->name);
+            unit_parse(unit, &parser);
+            continue;
+        }
+        taken[found] = true;
+        unit->node = ns->units[found].node;
+        unit->done = ns->units[found].done;
+        for (int k = 0; k < ns->units[found].refs.count; k++) {
+            name_list_add(&unit->refs, ns->units[found].refs.names[k]);
+        }
+    }
+    for (int j = 0; j < ns->unit_count; j++) {
+        if (!taken[j]) add_changed_name(changed, ns->units[j].name);
+    }
+    //変わった関数を呼ぶ関数も変わったものとして広げる
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (int i = 0; i < count; i++) {
+            if (units[i].name && !name_list_contains(changed, units[i].name) && refers_to_any(&units[i].refs, changed)) {
+                name_list_add(changed, units[i].name);
+                grew = true;
+            }
+        }
+    }
+
+    //変わった関数を使う文は、展開した本体が古いかもしれないので作り直す
+    //同じ名前の定義はまとめて作り直す
+    for (int i = 0; i < count; i++) {
+        WatchUnit* unit = &units[i];
+        if (unit->parsed) continue;
+        if (unit->name ? name_list_contains(changed, unit->name) : refers_to_any(&unit->refs, changed)) {
+            unit_parse(unit, &parser);
+        }
+    }
+    cleanup_tokens(ns);
+    ns->stats.parse_ms += elapsed_ms(&clock);
+
+    //ここから先は失敗しないので、古い定義を捨てて新しい文を最適化する
+    for (int i = 0; i < changed->count; i++) {
+        forget_function(&ns->functions, changed->names[i]);
+        env_unbind_function(ns->globals, changed->names[i]);
+    }
+    if (changed->count) memo_clear();
+
+    NsProgram* parsed = arena_alloc(sizeof(NsProgram));
+    parsed->statements = NULL;
+    parsed->count = 0;
+    int statement_capacity = 0;
+    for (int i = 0; i < count; i++) {
+        if (units[i].parsed) {
+            parsed->statements = arena_append(parsed->statements, parsed->count++, &statement_capacity, units[i].node);
+        }
+    }
+    ns->parse_count++;
+    optimize_program(parsed->statements, parsed->count);
+    ns->stats.optimize_ms += elapsed_ms(&clock);
+
+    //作り直した文、変わった関数を使う式の文、前回評価できなかった文を元の順に評価する
+    parsed->count = 0;
+    for (int i = 0; i < count; i++) {
+        WatchUnit* unit = &units[i];
+        if (unit->parsed || !unit->done) {
+            if (unit->name) env_unbind_function(ns->globals, unit->name);
+            parsed->statements = arena_append(parsed->statements, parsed->count++, &statement_capacity, unit->node);
+            unit->done = false;
+        }
+        unit->parsed = false;
+    }
+
+    units_free(ns->units, ns->unit_count);
+    ns->units = units;
+    ns->unit_count = count;
+    free(changed->names);
+    free(build->taken);
+    free(build);
+    *program = parsed;
+    return ns->status;
+}
+
+NsStatus ns_update(NsInterp* ns, const char* source, int* evaluated) {
+    if (evaluated) *evaluated = 0;
+    NsInterp* saved;
+    if (!ns_enter(ns, &saved)) return NS_ERR_BUSY;
+
+    NsProgram* program = NULL;
+    update_units(ns, source, &program);
+    NsStatus status = ns_leave(ns, saved);
+    if (status != NS_OK) return status;
+
+    if (evaluated) *evaluated = program->count;
+    int finished;
+    status = eval_program(ns, program, NULL, &finished);
+    //評価する文は未了の印が付いた文と同じ順に並んでいる。エラーより前の文は次に繰り返さない
+    for (int i = 0; i < ns->unit_count && finished > 0; i++) {
+        if (!ns->units[i].done) {
+            ns->units[i].done = true;
+            finished--;
+        }
+    }
+    return status;
+}
+
+const char* ns_error(NsInterp* ns) {
+    return ns->error;
+}
+
+void ns_write_stats(NsInterp* ns, FILE* out, NsStatsFormat format) {
+    Stats* stats = &ns->stats;
+    int node_types = sizeof(stats->nodes) / sizeof(stats->nodes[0]);
+
+    if (format == NS_STATS_JSON) {
+        fprintf(out, "{\"phases_ms\": {\"lex\": %.3f, \"parse\": %.3f, \"optimize\": %.3f, \"eval\": %.3f}, ",
+                stats->lex_ms, stats->parse_ms, stats->optimize_ms, stats->eval_ms);
+        fprintf(out, "\"values\": {\"new\": %ld, \"reused\": %ld, \"stack\": %ld, \"retain\": %ld, \"release\": %ld, \"free\": %ld, \"peak_live\": %ld}, ",
+                stats->value_new, stats->value_reuse, stats->value_stack, stats->value_retain, stats->value_release, stats->value_free, stats->peak_values);
+        fprintf(out, "\"environments\": {\"new\": %ld, \"peak_live\": %ld}, ", stats->env_new, stats->peak_envs);
+        fprintf(out, "\"peak_eval_depth\": %d, \"nodes\": {", stats->peak_depth);
+        for (int i = 0; i < node_types; i++) {
+            fprintf(out, "%s\"%s\": %ld", i ? ", " : "", ast_type_names[i], stats->nodes[i]);
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "phase     lex %.3f ms, parse %.3f ms, optimize %.3f ms, eval %.3f ms\n",
+            stats->lex_ms, stats->parse_ms, stats->optimize_ms, stats->eval_ms);
+    fprintf(out, "values    %ld new, %ld reused, %ld stack, %ld retain, %ld release, %ld free, %ld peak live\n",
+            stats->value_new, stats->value_reuse, stats->value_stack, stats->value_retain, stats->value_release, stats->value_free, stats->peak_values);
+    fprintf(out, "envs      %ld new, %ld peak live\n", stats->env_new, stats->peak_envs);
+    fprintf(out, "depth     %d peak\n", stats->peak_depth);
+    for (int i = 0; i < node_types; i++) {
+        fprintf(out, "nodes     %-14s %ld\n", ast_type_names[i], stats->nodes[i]);
+    }
+}
+
+static const char* site_label(HeapSite* site) {
+    if (!site->node) return "(unknown)";
+    return ast_type_names[site->node->type];
+}
+
+static void write_site_name(FILE* out, HeapSite* site, const char* source_name) {
+    if (!site->node) {
+        fprintf(out, "(builtins and host calls)");
+        return;
+    }
+    fprintf(out, "%s (%s:%d:%d)", site_label(site), source_name, site->node->line, site->node->column);
+}
+
+static int compare_snapshot_bytes(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void write_snapshot(FILE* out, HeapSnapshot* snapshot, int index, bool detailed, const char* source_name) {
+    fprintf(out, "#-----------\nsnapshot=%d\n#-----------\n", index);
+    fprintf(out, "time=%zu\nmem_heap_B=%zu\nmem_heap_extra_B=0\nmem_stacks_B=0\n", snapshot->time, snapshot->heap_bytes);
+    if (!detailed) {
+        fprintf(out, "heap_tree=empty\n");
+        return;
+    }
+    fprintf(out, "heap_tree=%s\n", snapshot->peak ? "peak" : "detailed");
+
+    //バイト数の多い順に並べる。bytesとsitesを組にして並べ替える
+    struct { long bytes; HeapSite* site; }* order = malloc(sizeof(*order) * (snapshot->count + 1));
+    for (int i = 0; i < snapshot->count; i++) {
+        order[i].bytes = snapshot->bytes[i];
+        order[i].site = snapshot->sites[i];
+    }
+    qsort(order, snapshot->count, sizeof(*order), compare_snapshot_bytes);
+    fprintf(out, "n%d: %zu (heap allocation functions) malloc/new/new[], --alloc-fns, etc.\n",
+            snapshot->count, snapshot->heap_bytes);
+    for (int i = 0; i < snapshot->count; i++) {
+        fprintf(out, " n0: %ld 0x%lx: ", order[i].bytes, (unsigned long)(size_t)order[i].site);
+        write_site_name(out, order[i].site, source_name);
+        fprintf(out, "\n");
+    }
+    free(order);
+}
+
+//massifの形式で書くのでms_printやmassif-visualizerで読める
+void ns_write_heap_profile(NsInterp* ns, FILE* out, const char* source_name) {
+    HeapProfile* profile = &ns->profile;
+    fprintf(out, "desc: --heap-profile\ncmd: nullscript %s\ntime_unit: B\n", source_name);
+
+    //ピークは時刻の順に差し込み、10個に1個だけ詳細を書く
+    int index = 0;
+    bool peak_written = !profile->peak.time && !profile->peak.heap_bytes;
+    for (int i = 0; i < profile->snapshot_count; i++) {
+        HeapSnapshot* snapshot = &profile->snapshots[i];
+        if (!peak_written && profile->peak.time <= snapshot->time) {
+            write_snapshot(out, &profile->peak, index++, true, source_name);
+            peak_written = true;
+        }
+        bool last = i == profile->snapshot_count - 1;
+        write_snapshot(out, snapshot, index++, i % 10 == 0 || last, source_name);
+    }
+    if (!peak_written) write_snapshot(out, &profile->peak, index++, true, source_name);
+}
+
+static int compare_site_bytes(const void* a, const void* b) {
+    long x = (*(HeapSite* const*)a)->alloc_bytes, y = (*(HeapSite* const*)b)->alloc_bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void ns_write_heap_sites(NsInterp* ns, FILE* out, const char* source_name) {
+    HeapProfile* profile = &ns->profile;
+    HeapSite** sites = malloc(sizeof(HeapSite*) * (profile->site_count + 1));
+    int count = 0;
+    for (int i = -1; i < profile->site_count; i++) {
+        HeapSite* site = i < 0 ? &profile->unknown : profile->sites[i];
+        if (site->alloc_count) sites[count++] = site;
+    }
+    qsort(sites, count, sizeof(HeapSite*), compare_site_bytes);
+
+    fprintf(out, "heap: %zu bytes allocated, %zu live, %zu peak\n",
+            profile->total_bytes, profile->live_bytes, profile->peak_bytes);
+    fprintf(out, "%12s %10s %12s %10s  site\n", "total B", "count", "live B", "live");
+    for (int i = 0; i < count && i < 20; i++) {
+        fprintf(out, "%12ld %10ld %12ld %10ld  ", sites[i]->alloc_bytes, sites[i]->alloc_count,
+                sites[i]->live_bytes, sites[i]->live_count);
+        write_site_name(out, sites[i], source_name);
+        fprintf(out, "\n");
+    }
+    free(sites);
+}
+
+void ns_write_memo_stats(NsInterp* ns, FILE* out) {
+    fprintf(out, "memo: %ld hits, %ld misses, %ld evictions, %d entries\n",
+            ns->memo.hits, ns->memo.misses, ns->memo.evictions, ns->memo.size);
+}
+
+ValueType ns_type(Value* val) {
+    return value_type(val);
+}
+
+Value* ns_car(Value* val) {
+    return value_type(val) == VAL_PAIR ? pair_car(val) : NULL;
+}
+
+Value* ns_cdr(Value* val) {
+    return value_type(val) == VAL_PAIR ? pair_cdr(val) : NULL;
+}
+
+Value* ns_atom(ValueType type) {
+    switch (type) {
+        case VAL_NONE: return make_none();
+        case VAL_NIL: return make_nil();
+        case VAL_UNDEFINED: return make_undefined();
+        case VAL_NULL: return make_null();
+        default: return NULL;
+    }
+}
+
+Value* ns_pair(Value* car, Value* cdr) {
+    return make_pair(car, cdr);
+}
+
+Value* ns_number(int n) {
+    if (n <= 0) return make_nil();
+    Value** elements = malloc(sizeof(Value*) * n);
+    for (int i = 0; i < n; i++) {
+        elements[i] = make_none();
+    }
+    Value* list = make_list(elements, n, make_nil());
+    free(elements);
+    return list;
+}
+
+int ns_to_number(Value* val) {
+    return encoding_to_number(val);
+}
+
+void ns_retain(Value* val) {
+    value_retain(val);
+}
+
+void ns_release(Value* val) {
+    value_release(val);
+}
+
+Value* ns_raise(Environment* env, const char* format, ...) {
+    (void)env;
+    if (current->status == NS_OK) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(current->error, sizeof(current->error), format, args);
+        va_end(args);
+        current->status = NS_ERR_RUNTIME;
+    }
+    return NULL;
+}
+
+//スケジューラ
+
+#define JOB_STACK_SIZE (8 * 1024 * 1024)
+
+NsScheduler* ns_scheduler_new(int threads, long slice) {
+    NsScheduler* scheduler = calloc(1, sizeof(NsScheduler));
+    scheduler->worker_count = threads > 0 ? threads : 1;
+    scheduler->slice = slice > 0 ? slice : 10000;
+    scheduler->workers = calloc(scheduler->worker_count, sizeof(Worker));
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+    }
+    return scheduler;
+}
+
+static void job_free(Job* job) {
+    job->ns->job = NULL;
+    munmap(job->stack, JOB_STACK_SIZE);
+    free(job->source);
+    free(job);
+}
+
+void ns_scheduler_free(NsScheduler* scheduler) {
+    if (!scheduler) return;
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        Job* job = scheduler->workers[i].head;
+        while (job) {
+            Job* next = job->next;
+            job_free(job);
+            job = next;
+        }
+    }
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+static void job_main(void) {
+    Job* job = worker_self->running;
+    ns_run(job->ns, job->source);
+    job->done = true;
+    setcontext(&worker_self->context);
+}
+
+static void worker_push(Worker* worker, Job* job) {
+    job->next = NULL;
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+}
+
+NsStatus ns_schedule(NsScheduler* scheduler, NsInterp* ns, const char* source) {
+    if (ns->running || ns->job) return NS_ERR_BUSY;
+
+    //スタックは使った分だけ確保される。先頭のページは溢れ検出用
+    void* stack = mmap(NULL, JOB_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) return NS_ERR_MEMORY;
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+    Job* job = calloc(1, sizeof(Job));
+    job->ns = ns;
+    job->source = strdup(source);
+    job->stack = stack;
+    job->slice = scheduler->slice;
+    getcontext(&job->context);
+    job->context.uc_stack.ss_sp = stack;
+    job->context.uc_stack.ss_size = JOB_STACK_SIZE;
+    job->context.uc_link = NULL;
+    makecontext(&job->context, job_main, 0);
+
+    ns->job = job;
+    ns->slice_used = 0;
+    worker_push(&scheduler->workers[scheduler->next_worker], job);
+    scheduler->next_worker = (scheduler->next_worker + 1) % scheduler->worker_count;
+    return NS_OK;
+}
+
+//自分のキューを順番に一スライスずつ進める
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    worker_self = worker;
+
+    while (worker->head) {
+        Job* job = worker->head;
+        worker->head = job->next;
+        if (!worker->head) worker->tail = NULL;
+
+        worker->running = job;
+        swapcontext(&worker->context, &job->context);
+        worker->running = NULL;
+
+        if (job->done) {
+            job_free(job);
+        } else {
+            worker_push(worker, job);
+        }
+    }
+
+    worker_self = NULL;
+    current = NULL;
+    return NULL;
+}
+
+void ns_scheduler_run(NsScheduler* scheduler) {
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        pthread_create(&scheduler->workers[i].thread, NULL, worker_main, &scheduler->workers[i]);
+    }
+    for (int i = 0; i < scheduler->worker_count; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+}
+
+NsStatus ns_status(NsInterp* ns) {
+    return ns->status;
+}
@@ -0,0 +1,114 @@
+#ifndef NULLSCRIPT_H
+#define NULLSCRIPT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    VAL_NONE,
+    VAL_NIL,
+    VAL_UNDEFINED,
+    VAL_NULL,
+    VAL_PAIR,
+    VAL_FUNCTION,
+    VAL_BUILTIN,
+    VAL_STREAM,
+    VAL_FUTURE
+} ValueType;
+
+typedef struct Value Value;
+typedef struct Environment Environment;
+typedef struct NsInterp NsInterp;
+typedef struct NsProgram NsProgram;
+typedef struct NsScheduler NsScheduler;
+
+typedef Value* (*NsBuiltin)(Value** args, int argc, Environment* env);
+
+typedef enum {
+    NS_OK,
+    NS_ERR_SYNTAX,
+    NS_ERR_RUNTIME,
+    NS_ERR_FUEL,
+    NS_ERR_MEMORY,
+    NS_ERR_DEPTH,
+    NS_ERR_BUSY
+} NsStatus;
+
+typedef enum {
+    NS_STATS_TEXT,
+    NS_STATS_JSON
+} NsStatsFormat;
+
+//0の制限は無制限
+typedef struct {
+    bool cse;
+    //本体のノード数がこれ以下の関数は呼び出し元に展開する。0なら展開しない
+    int inline_size;
+    bool memo;
+    int memo_size;
+    long fuel;
+    size_t max_heap;
+    int max_depth;
+    FILE* output;
+    //future用のプールのスレッド数。0ならCPUの数。プロセスで最初に使った値が有効
+    int future_threads;
+    //値の割り当てを式ごとに数える。ns_write_heap_profileで書き出す
+    bool heap_profile;
+    //値や環境の数、評価したノードを数える。ns_write_statsで書き出す
+    bool stats;
+} NsOptions;
+
+void ns_default_options(NsOptions* options);
+
+NsInterp* ns_new(const NsOptions* options);
+void ns_free(NsInterp* ns);
+
+NsStatus ns_register_builtin(NsInterp* ns, const char* name, NsBuiltin func);
+
+//パースしたプログラムはnsが持ち、ns_freeで解放される
+NsStatus ns_parse(NsInterp* ns, const char* source, NsProgram** program);
+//resultを受け取った場合はns_releaseで解放する
+NsStatus ns_eval(NsInterp* ns, NsProgram* program, Value** result);
+NsStatus ns_run(NsInterp* ns, const char* source);
+//sourceを前回のns_updateと文ごとに比べ、変わった文と変わった関数に依存する文だけ評価する
+//最初の呼び出しはns_runと同じ。evaluatedには評価した文の数が入る
+NsStatus ns_update(NsInterp* ns, const char* source, int* evaluated);
+
+NsStatus ns_status(NsInterp* ns);
+const char* ns_error(NsInterp* ns);
+void ns_write_stats(NsInterp* ns, FILE* out, NsStatsFormat format);
+void ns_write_memo_stats(NsInterp* ns, FILE* out);
+//heap_profileを有効にした時だけ意味がある。source_nameは位置の表示に使う
+void ns_write_heap_profile(NsInterp* ns, FILE* out, const char* source_name);
+void ns_write_heap_sites(NsInterp* ns, FILE* out, const char* source_name);
+
+//threads本のOSスレッドで、各ジョブをslice個のノードごとに切り替えて進める
+NsScheduler* ns_scheduler_new(int threads, long slice);
+void ns_scheduler_free(NsScheduler* scheduler);
+//nsはジョブが終わるまで他から使わない。結果はns_status/ns_errorで見る
+NsStatus ns_schedule(NsScheduler* scheduler, NsInterp* ns, const char* source);
+//投入済みのジョブがすべて終わるまで戻らない
+void ns_scheduler_run(NsScheduler* scheduler);
+
+//ホスト関数用。car/cdrは借用参照を返す
+ValueType ns_type(Value* val);
+Value* ns_car(Value* val);
+Value* ns_cdr(Value* val);
+Value* ns_atom(ValueType type);
+Value* ns_pair(Value* car, Value* cdr);
+Value* ns_number(int n);
+int ns_to_number(Value* val);
+void ns_retain(Value* val);
+void ns_release(Value* val);
+Value* ns_raise(Environment* env, const char* format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
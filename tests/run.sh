@@ -0,0 +1,44 @@
+#!/bin/sh
+# 例と回帰用のプログラムを最適化の設定ごとに実行し、期待する出力と比べる
+# 使い方: tests/run.sh [nullscript]
+
+NS=${1:-build/nullscript}
+DIR=$(dirname "$0")
+ACTUAL=$(mktemp)
+trap 'rm -f "$ACTUAL"' EXIT
+failed=0
+count=0
+
+# check 期待する出力 コマンド...
+check() {
+    expected=$1
+    shift
+    count=$((count + 1))
+    "$@" > "$ACTUAL" 2>/dev/null
+    if ! diff -u "$expected" "$ACTUAL"; then
+        echo "FAIL: $*"
+        failed=$((failed + 1))
+    fi
+}
+
+for flags in "" --no-cse --no-inline --memo; do
+    for program in "$DIR"/../example/*.ns "$DIR"/*.ns; do
+        name=$(basename "$program" .ns)
+        check "$DIR/expected/$name.out" "$NS" $flags "$program"
+    done
+done
+
+# 上限を試すプログラムは上限を付けて一度だけ実行する
+check "$DIR/expected/big_literal.out" "$NS" --max-heap=1000000 "$DIR/limits/big_literal.ns"
+
+# 一本のスレッドなら切り替えの順は決まっている
+check "$DIR/expected/jobs_slice.out" "$NS" --threads=1 --slice=10 "$DIR/jobs/a.ns" "$DIR/jobs/b.ns"
+check "$DIR/expected/jobs_whole.out" "$NS" --threads=1 --slice=100000 "$DIR/jobs/a.ns" "$DIR/jobs/b.ns"
+
+# futureの結果はプールの大きさによらず逐次の評価と同じ
+for threads in 1 2 8; do
+    check "$DIR/expected/futures.out" "$NS" --future-threads=$threads "$DIR/futures.ns"
+done
+
+echo "$count checks, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,85 @@
+//ns_updateに書き換えたソースを順に渡し、評価した文の数と出力を確かめる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nullscript.h"
+
+typedef struct {
+    const char* name;
+    const char* source;
+    NsStatus status;
+    int evaluated;
+    const char* output;
+} Step;
+
+#define DEFS \
+    "function inc(n) { pair(none, n) }\n" \
+    "function two() { inc(inc(nil)) }\n" \
+    "function seven() { #7 }\n"
+
+static const Step steps[] = {
+    {"first run", DEFS "print(pair(none, two()))\nprint(pair(none, seven()))\n", NS_OK, 5, "27"},
+    {"unchanged", DEFS "print(pair(none, two()))\nprint(pair(none, seven()))\n", NS_OK, 0, ""},
+    {"whitespace only",
+     "function inc(n) {\n    pair(none, n)\n}\n\nfunction two() { inc(inc(nil)) }\nfunction seven() { #7 }\n"
+     "print(pair(none, two()))\nprint(pair(none, seven()))\n", NS_OK, 0, ""},
+    //incに依存するtwoと、twoを使う文だけ評価し直す
+    {"body edited",
+     "function inc(n) { pair(none, pair(none, n)) }\nfunction two() { inc(inc(nil)) }\nfunction seven() { #7 }\n"
+     "print(pair(none, two()))\nprint(pair(none, seven()))\n", NS_OK, 3, "4"},
+    {"statement moved",
+     "function inc(n) { pair(none, pair(none, n)) }\nfunction two() { inc(inc(nil)) }\nfunction seven() { #7 }\n"
+     "print(pair(none, seven()))\nprint(pair(none, two()))\n", NS_OK, 0, ""},
+    {"parse error", "function inc(n) { pair(none, }\n" DEFS, NS_ERR_SYNTAX, 0, ""},
+    {"unclosed expression", DEFS "print(pair(none, two())\n", NS_ERR_SYNTAX, 0, ""},
+    //エラーの前の状態から比べるので、incを戻した分だけ評価する
+    {"fixed after parse error", DEFS "print(pair(none, seven()))\nprint(pair(none, two()))\n", NS_OK, 3, "2"},
+    //エラーで止まった文から後だけを次に評価する
+    {"runtime error", DEFS "print(pair(none, seven()))\nprint(pair(none, two()))\nprint(pair(none, #3))\nprint(pair(none, car(nil)))\nprint(pair(none, #5))\n",
+     NS_ERR_RUNTIME, 3, "3"},
+    {"fixed after runtime error", DEFS "print(pair(none, seven()))\nprint(pair(none, two()))\nprint(pair(none, #3))\nprint(pair(none, #4))\nprint(pair(none, #5))\n",
+     NS_OK, 2, "45"},
+    //後の定義が有効。どちらを変えても両方作り直す
+    {"defined twice", DEFS "function seven() { #8 }\nprint(pair(none, seven()))\n", NS_OK, 3, "8"},
+    {"first of two edited", "function inc(n) { pair(none, n) }\nfunction two() { inc(inc(nil)) }\nfunction seven() { #9 }\n"
+     "function seven() { #8 }\nprint(pair(none, seven()))\n", NS_OK, 3, "8"},
+    {"second removed", DEFS "print(pair(none, seven()))\n", NS_OK, 2, "7"},
+    {"function removed", "function inc(n) { pair(none, n) }\nprint(pair(none, seven()))\n", NS_ERR_RUNTIME, 1, ""},
+};
+
+int main(void) {
+    FILE* out = tmpfile();
+    NsOptions options;
+    ns_default_options(&options);
+    options.output = out;
+    NsInterp* ns = ns_new(&options);
+
+    int failed = 0;
+    int count = sizeof(steps) / sizeof(steps[0]);
+    for (int i = 0; i < count; i++) {
+        const Step* step = &steps[i];
+        rewind(out);
+        if (ftruncate(fileno(out), 0) != 0) return 1;
+
+        int evaluated = -1;
+        NsStatus status = ns_update(ns, step->source, &evaluated);
+        fflush(out);
+        char output[256];
+        rewind(out);
+        size_t length = fread(output, 1, sizeof(output) - 1, out);
+        output[length] = '\0';
+
+        if (status != step->status || evaluated != step->evaluated || strcmp(output, step->output) != 0) {
+            printf("FAIL: %s: status %d, %d evaluated, output \"%s\"; expected status %d, %d evaluated, output \"%s\"\n",
+                   step->name, status, evaluated, output, step->status, step->evaluated, step->output);
+            if (status != NS_OK) printf("  error: %s\n", ns_error(ns));
+            failed++;
+        }
+    }
+
+    ns_free(ns);
+    fclose(out);
+    printf("%d updates, %d failed\n", count, failed);
+    return failed ? 1 : 0;
+}